@@ -25,7 +25,7 @@ namespace etsl {
         vec.erase(std::unique(begin(vec), end(vec)), end(vec));
     }
 
-    void trim_inplace(std::string& s)
+    inline void trim_inplace(std::string& s)
     {
         auto from = begin(s);
         auto to = from;
@@ -43,6 +43,32 @@ namespace etsl {
             s.pop_back();
         }
     }
+
+    // 64-bit FNV-1a hash.
+    inline unsigned long long fnv1a_hash(const char* data, size_t size)
+    {
+        unsigned long long h = 14695981039346656037ull;
+        for (size_t i = 0; i < size; ++i) {
+            h ^= static_cast<unsigned char>(data[i]);
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+    inline unsigned long long fnv1a_hash(const std::string& s)
+    {
+        return fnv1a_hash(s.data(), s.size());
+    }
+
+    // Returns the directory of the path ("" for the current one).
+    inline std::string parent_directory(const std::string& path)
+    {
+        auto pos = path.rfind('/');
+        if (pos == std::string::npos) {
+            return "";
+        }
+        return path.substr(0, pos == 0 ? 1 : pos);
+    }
 }
 
 #endif
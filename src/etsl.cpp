@@ -0,0 +1,437 @@
+/*
+ * Copyright (c) 2017, Yutaka Tsutano
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cctype>
+#include <cstdio>
+#include <thread>
+
+#include "etsl.hpp"
+#include "etsl_parser.hpp"
+#include "etsl_parallel_parser.hpp"
+#include "etsl_import.hpp"
+#include "etsl_frame_enumerator.hpp"
+#include "etsl_frame_counter.hpp"
+#include "etsl_frame_writer.hpp"
+#include "etsl_mmap_writer.hpp"
+#include "etsl_oracle.hpp"
+#include "etsl_delta_stream.hpp"
+#include "etsl_checkpoint.hpp"
+#include "etsl_coverage.hpp"
+#include "etsl_compressed_streambuf.hpp"
+#include "etsl_server.hpp"
+
+namespace etsl {
+    std::vector<int> parse_frame_key(const std::string& str)
+    {
+        std::vector<int> key;
+        int n = 0;
+        bool has_digit = false;
+        for (char c : str) {
+            if (std::isdigit(static_cast<unsigned char>(c))) {
+                n = n * 10 + (c - '0');
+                has_digit = true;
+            }
+            else if (c == '.' && has_digit) {
+                key.push_back(n - 1);
+                n = 0;
+                has_digit = false;
+            }
+            else {
+                throw std::runtime_error("invalid key " + str);
+            }
+        }
+        if (has_digit) {
+            throw std::runtime_error("invalid key " + str);
+        }
+        return key;
+    }
+
+    namespace details {
+        // Writes the frames, reporting the progress and saving checkpoints
+        // as requested.
+        static unsigned long long
+        write_monitored_frames(const etsl_spec& spec, std::ostream& os,
+                               etsl_write_options options,
+                               const std::string& checkpoint_filename,
+                               unsigned long long spec_hash)
+        {
+            unsigned long long total_frames = 0;
+            if (options.report_progress) {
+                try {
+                    total_frames = spec.count_frames();
+                }
+                catch (std::runtime_error&) {
+                    // Too many to count; report without the total.
+                }
+            }
+
+            etsl_progress_monitor monitor(
+                    os, checkpoint_filename, spec_hash, options.order,
+                    options.report_progress, total_frames,
+                    options.resume_from != nullptr
+                            ? options.resume_from->frame_num
+                            : 0);
+            auto on_progress = options.on_progress;
+            options.on_progress = [&](const etsl_frame_position& pos) {
+                monitor(pos);
+                if (on_progress) {
+                    on_progress(pos);
+                }
+            };
+            options.report_progress = false;
+
+            auto frame_num = spec.write_frames(os, options);
+            monitor.finish(frame_num);
+            return frame_num;
+        }
+    }
+
+    etsl_spec::etsl_spec(std::shared_ptr<const etsl_file> file,
+                         unsigned long long hash)
+            : file_(std::move(file)), hash_(hash)
+    {
+    }
+
+    etsl_spec etsl_spec::parse(const char* data, std::size_t size,
+                               const std::string& import_dir,
+                               std::size_t num_threads)
+    {
+        etsl_import_cache imports;
+
+        // Large inputs are tokenized and parsed in parallel when there is
+        // more than one core to run on.
+        if (num_threads == 0) {
+            num_threads = std::thread::hardware_concurrency();
+        }
+        std::shared_ptr<const etsl_file> file;
+        if (size >= (1 << 20) && num_threads > 1) {
+            file = std::make_shared<const etsl_file>(etsl_parse_parallel(
+                    data, size, num_threads, imports.loader(import_dir)));
+        }
+        else {
+            auto tokens = etsl_tokenize(data, size);
+            file = std::make_shared<const etsl_file>(
+                    etsl_parse(tokens, imports.loader(import_dir)));
+        }
+
+        // The content of the sub-specs imported is part of the spec too.
+        etsl_spec spec(std::move(file), fnv1a_hash(data, size));
+        for (auto h : spec.imported_file_hashes()) {
+            spec.hash_ = (spec.hash_ ^ h) * 1099511628211ull;
+        }
+        return spec;
+    }
+
+    etsl_spec etsl_spec::parse(const std::string& input,
+                               const std::string& import_dir,
+                               std::size_t num_threads)
+    {
+        return parse(input.data(), input.size(), import_dir, num_threads);
+    }
+
+    etsl_spec etsl_spec::parse_file(const std::string& filename,
+                                    std::size_t num_threads)
+    {
+        std::ifstream ifs(filename);
+        if (!ifs) {
+            throw std::runtime_error("cannot open " + filename);
+        }
+
+        std::ostringstream oss;
+        oss << ifs.rdbuf();
+        return parse(oss.str(), parent_directory(filename), num_threads);
+    }
+
+    std::vector<std::string> etsl_spec::imported_files() const
+    {
+        std::vector<std::string> paths;
+        for (const auto& imp : file_->imports) {
+            paths.push_back(imp.path);
+        }
+        unique_sort(paths);
+        return paths;
+    }
+
+    std::vector<unsigned long long> etsl_spec::imported_file_hashes() const
+    {
+        std::vector<std::pair<std::string, unsigned long long>> files;
+        for (const auto& imp : file_->imports) {
+            files.emplace_back(imp.path, imp.hash);
+        }
+        unique_sort(files);
+
+        std::vector<unsigned long long> hashes;
+        for (const auto& f : files) {
+            hashes.push_back(f.second);
+        }
+        return hashes;
+    }
+
+    std::size_t etsl_spec::num_categories() const
+    {
+        return file_->categories.size();
+    }
+
+    const std::string& etsl_spec::category_name(std::size_t cat) const
+    {
+        return file_->categories.at(cat).name;
+    }
+
+    std::size_t etsl_spec::num_choices(std::size_t cat) const
+    {
+        return file_->categories.at(cat).num_choices();
+    }
+
+    std::string etsl_spec::choice_name(std::size_t cat, int choice) const
+    {
+        const auto& category = file_->categories.at(cat);
+        if (choice == -1) {
+            return "<n/a>";
+        }
+        if (choice < 0 || static_cast<size_t>(choice) >= category.num_choices()) {
+            throw std::out_of_range("choice out of range");
+        }
+        return category.choice_name(choice);
+    }
+
+    unsigned long long etsl_spec::count_frames() const
+    {
+        return count_tsl_frames(*file_);
+    }
+
+    unsigned long long etsl_spec::count_normal_frames() const
+    {
+        details::etsl_frame_counter counter(*file_);
+        return counter.count();
+    }
+
+    void etsl_spec::visit_frames(
+            const std::function<void(const etsl_frame&)>& visitor,
+            frame_order order) const
+    {
+        details::etsl_frame_counter counter(*file_);
+        etsl_frame frame;
+        frame.number = counter.count_single();
+
+        details::etsl_frame_enumerator enumerator(*file_, order);
+        enumerator.enumerate(
+                [&](const std::vector<details::category_choice_state>& states) {
+                    ++frame.number;
+                    frame.key.clear();
+                    for (const auto& st : states) {
+                        frame.key.push_back(st.selected);
+                    }
+                    visitor(frame);
+                });
+    }
+
+    unsigned long long
+    etsl_spec::write_frames(std::ostream& os,
+                            const etsl_write_options& options) const
+    {
+        if (options.report_progress) {
+            return details::write_monitored_frames(*this, os, options, "",
+                                                   hash_);
+        }
+        return write_tsl_frames(os, *file_, options);
+    }
+
+    unsigned long long etsl_spec::write_frames_checkpointed(
+            const std::string& filename,
+            const std::string& checkpoint_filename,
+            const etsl_write_options& options, bool resume) const
+    {
+        etsl_write_options ckpt_options = options;
+        ckpt_options.resume_from = nullptr;
+
+        // Continue from the last checkpoint if any.
+        etsl_checkpoint ckpt;
+        bool resuming = resume && read_checkpoint(checkpoint_filename, ckpt);
+        if (resuming) {
+            if (ckpt.spec_hash != hash_ || ckpt.order != options.order) {
+                throw std::runtime_error(checkpoint_filename
+                                         + " does not match the input");
+            }
+            ckpt_options.resume_from = &ckpt.position;
+        }
+
+        std::fstream fs;
+        if (resuming) {
+            // The partial output is a prefix of the complete output, so it
+            // can be overwritten from the checkpoint on.
+            fs.open(filename, std::ios::in | std::ios::out);
+            fs.seekp(ckpt.offset);
+        }
+        else {
+            fs.open(filename, std::ios::out | std::ios::trunc);
+        }
+        if (!fs) {
+            throw std::runtime_error("cannot open " + filename);
+        }
+
+        auto frame_num = details::write_monitored_frames(
+                *this, fs, ckpt_options, checkpoint_filename, hash_);
+        if (!fs.flush()) {
+            throw std::runtime_error("cannot write " + filename);
+        }
+
+        std::remove(checkpoint_filename.c_str());
+        return frame_num;
+    }
+
+    unsigned long long etsl_spec::frames_size() const
+    {
+        return tsl_frames_size(*file_);
+    }
+
+    unsigned long long
+    etsl_spec::write_delta_frames(std::ostream& os, frame_order order,
+                                  unsigned long long keyframe_interval) const
+    {
+        std::vector<std::string> names;
+        std::vector<std::size_t> num_choices;
+        for (const auto& cat : file_->categories) {
+            names.push_back(cat.name);
+            num_choices.push_back(cat.num_choices());
+        }
+        etsl_delta_writer writer(os, names, num_choices, keyframe_interval);
+
+        details::etsl_frame_counter counter(*file_);
+        const auto first_num = counter.count_single();
+        auto frame_num = first_num;
+        std::vector<int> key(names.size());
+
+        details::etsl_frame_enumerator enumerator(*file_, order);
+        enumerator.enumerate(
+                [&](const std::vector<details::category_choice_state>& states) {
+                    for (size_t i = 0; i < states.size(); ++i) {
+                        key[i] = states[i].selected;
+                    }
+                    writer.write(++frame_num, key.data());
+                });
+        writer.finish();
+        return frame_num - first_num;
+    }
+
+    unsigned long long etsl_spec::write_frames_mmap(const std::string& filename,
+                                                    std::size_t num_threads) const
+    {
+        return write_tsl_frames_mmap(filename, *file_, num_threads);
+    }
+
+    void etsl_spec::write_sampled_frames(std::ostream& os,
+                                         unsigned long long n,
+                                         unsigned long long seed,
+                                         bool unique) const
+    {
+        write_sampled_tsl_frames(os, *file_, n, seed, unique);
+    }
+
+    bool etsl_spec::write_frame(std::ostream& os,
+                                const std::vector<int>& key) const
+    {
+        return write_tsl_frame(os, *file_, key);
+    }
+
+    bool etsl_spec::is_expectation_category(std::size_t cat) const
+    {
+        return file_->categories.at(cat).mutually_exclusive;
+    }
+
+    void etsl_spec::evaluate_expectations(int* keys, std::size_t num_keys) const
+    {
+        etsl::evaluate_expectations(*file_, keys, num_keys);
+    }
+
+    void etsl_spec::answer_expectation_queries(std::istream& is,
+                                               std::ostream& os) const
+    {
+        etsl::answer_expectation_queries(is, os, *file_);
+    }
+
+    void etsl_spec::write_coverage_report(std::istream& frames,
+                                          std::ostream& report,
+                                          frame_format format,
+                                          std::size_t t) const
+    {
+        etsl_coverage coverage(*file_, t);
+        switch (format) {
+        case frame_format::keys:
+            coverage.add_frames(frames);
+            break;
+        case frame_format::records:
+            coverage.add_frame_records(frames);
+            break;
+        case frame_format::delta:
+            coverage.add_delta_frames(frames);
+            break;
+        }
+        coverage.write_report(report);
+    }
+
+    compression_format parse_compression_format(const std::string& name)
+    {
+        if (name == "gzip") {
+#ifdef ETSL_HAVE_ZLIB
+            return compression_format::gzip;
+#endif
+        }
+        else if (name == "zstd") {
+#ifdef ETSL_HAVE_ZSTD
+            return compression_format::zstd;
+#endif
+        }
+        else {
+            throw std::runtime_error("unknown compression format " + name);
+        }
+        throw std::runtime_error(name + " is not supported by this build");
+    }
+
+    void write_compressed(std::ostream& os, compression_format format,
+                          std::ostream* index_os,
+                          const std::function<void(std::ostream&)>& write)
+    {
+        etsl_compressed_streambuf buf(os, format, index_os);
+        std::ostream compressed_os(&buf);
+        write(compressed_os);
+        buf.finish();
+        if (!compressed_os || !os) {
+            throw std::runtime_error("cannot write the compressed output");
+        }
+    }
+
+    void serve_etsl_requests(std::istream& is, std::ostream& os)
+    {
+        etsl_spec_cache cache;
+        details::serve_etsl_requests(is, os, cache);
+    }
+
+    void serve_etsl_unix_socket(const std::string& path,
+                                std::size_t max_clients)
+    {
+        details::serve_etsl_unix_socket(path, max_clients);
+    }
+
+    void request_etsl_server(const std::string& path,
+                             const std::vector<std::string>& args,
+                             std::ostream& payload_os)
+    {
+        details::request_etsl_server(path, args, payload_os);
+    }
+}
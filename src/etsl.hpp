@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) 2017, Yutaka Tsutano
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// Public interface of libetsl. This is installed with the library along with
+// etsl_delta_stream.hpp, which reads the delta streams it writes.
+
+#ifndef ETSL_HPP
+#define ETSL_HPP
+
+#include <iosfwd>
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <stdexcept>
+#include <cstddef>
+
+namespace etsl {
+    struct etsl_syntax_error : std::runtime_error {
+        int line_num;
+        int col_num;
+
+        etsl_syntax_error(int line_num, int col_num, std::string what)
+                : runtime_error(what), line_num(line_num), col_num(col_num)
+        {
+        }
+    };
+
+    // Order in which the normal frames are written. The keys of the frames
+    // are the same in any order.
+    enum class frame_order {
+        // Depth-first order of the choices (the order of the keys).
+        lexicographic,
+
+        // Reflected Gray order: adjacent frames differ in as few categories as
+        // possible.
+        gray
+    };
+
+    // Position of the writer right after writing a normal frame, from which
+    // writing can be resumed.
+    struct etsl_frame_position {
+        // Number of frames written so far, including single frames.
+        unsigned long long frame_num = 0;
+
+        // Selected choice of each category in the last frame (-1 for <n/a>).
+        std::vector<int> key;
+
+        // Whether each category is being visited in reverse order.
+        std::vector<bool> reversed;
+    };
+
+    struct etsl_write_options {
+        frame_order order = frame_order::lexicographic;
+
+        // If set, the frames up to this position are assumed to have been
+        // written already and are skipped.
+        const etsl_frame_position* resume_from = nullptr;
+
+        // If not 0, stops after writing this many normal frames.
+        unsigned long long max_frames = 0;
+
+        // Called after every progress_interval normal frames.
+        std::function<void(const etsl_frame_position&)> on_progress;
+        unsigned long long progress_interval = 4096;
+
+        // If set, the number of frames written and the rate are reported to
+        // stderr every second.
+        bool report_progress = false;
+    };
+
+    // Normal frame passed to the visitor of etsl_spec::visit_frames().
+    struct etsl_frame {
+        // Test Case number as written by etsl_spec::write_frames().
+        unsigned long long number;
+
+        // Selected choice of each category (-1 for <n/a>).
+        std::vector<int> key;
+    };
+
+    // Form of the executed frames read by
+    // etsl_spec::write_coverage_report().
+    enum class frame_format {
+        // Keys one per line (e.g., "1.3.0."), or frames as written by
+        // etsl_spec::write_frames().
+        keys,
+
+        // Records of one little-endian 32-bit integer per category: the
+        // selected choice (-1 for <n/a>).
+        records,
+
+        // Delta stream written for the same spec.
+        delta
+    };
+
+    // Format of the independently compressed blocks written by
+    // write_compressed().
+    enum class compression_format { gzip, zstd };
+
+    // Parses a key as written in the frame headings (e.g., "1.3.0.") into the
+    // selected choice of each category (-1 for <n/a>).
+    std::vector<int> parse_frame_key(const std::string& str);
+
+    struct etsl_file;
+
+    // Parsed ETSL specification. Copies share the parsed data, which is never
+    // modified, so a spec can be used from multiple threads.
+    class etsl_spec {
+    private:
+        std::shared_ptr<const etsl_file> file_;
+
+        // Hash of the input and the sub-specs imported, which identifies the
+        // spec in checkpoints.
+        unsigned long long hash_;
+
+    private:
+        etsl_spec(std::shared_ptr<const etsl_file> file,
+                  unsigned long long hash);
+
+    public:
+        // Throws etsl_syntax_error on a syntax error, including those in the
+        // sub-specs imported, whose paths are relative to import_dir (the
+        // current directory if empty). Large inputs are parsed on num_threads
+        // threads (0 for all the hardware supports, 1 to parse serially).
+        static etsl_spec parse(const char* data, std::size_t size,
+                               const std::string& import_dir = "",
+                               std::size_t num_threads = 0);
+        static etsl_spec parse(const std::string& input,
+                               const std::string& import_dir = "",
+                               std::size_t num_threads = 0);
+
+        // Throws std::runtime_error if the file cannot be read. The imports
+        // are relative to the directory of the file.
+        static etsl_spec parse_file(const std::string& filename,
+                                    std::size_t num_threads = 0);
+
+        // Resolved paths of the sub-specs imported, directly or not.
+        std::vector<std::string> imported_files() const;
+
+        // Hashes of the content the sub-specs in imported_files() were
+        // parsed from, in the same order.
+        std::vector<unsigned long long> imported_file_hashes() const;
+
+        std::size_t num_categories() const;
+        const std::string& category_name(std::size_t cat) const;
+        std::size_t num_choices(std::size_t cat) const;
+
+        // Returns "<n/a>" for choice -1. The choices of a range or values
+        // category are named by their values.
+        std::string choice_name(std::size_t cat, int choice) const;
+
+        // Number of frames including single and error frames.
+        unsigned long long count_frames() const;
+        unsigned long long count_normal_frames() const;
+
+        // Calls the visitor for each normal frame without writing it.
+        void visit_frames(const std::function<void(const etsl_frame&)>& visitor,
+                          frame_order order = frame_order::lexicographic) const;
+
+        // Returns the number of frames written, including those skipped when
+        // resuming.
+        unsigned long long
+        write_frames(std::ostream& os,
+                     const etsl_write_options& options = {}) const;
+
+        // Writes the frames to the file as write_frames() does, saving the
+        // position of the writer to checkpoint_filename every 10 seconds. If
+        // resume is set and the checkpoint exists, the interrupted run is
+        // continued from it, completing the partial output in the file,
+        // instead of options.resume_from. The checkpoint is removed once all
+        // the frames are written. Returns the number of frames written.
+        // Throws std::runtime_error if the checkpoint was saved for another
+        // spec or order, or if the file cannot be written.
+        unsigned long long
+        write_frames_checkpointed(const std::string& filename,
+                                  const std::string& checkpoint_filename,
+                                  const etsl_write_options& options = {},
+                                  bool resume = false) const;
+
+        // Size in bytes of the output of write_frames() in any order,
+        // computed from the frame counts without writing the frames.
+        unsigned long long frames_size() const;
+
+        // Writes the keys of the normal frames as a delta stream (see
+        // etsl_delta_stream.hpp), with a keyframe every keyframe_interval
+        // frames. Returns the number of normal frames written.
+        unsigned long long
+        write_delta_frames(std::ostream& os,
+                           frame_order order = frame_order::lexicographic,
+                           unsigned long long keyframe_interval = 4096) const;
+
+        // Writes the same output as write_frames() in lexicographic order to
+        // a file on num_threads threads (0 for all the hardware supports),
+        // each writing its own part of the memory-mapped file. Returns the
+        // number of frames written. Throws std::runtime_error if the file
+        // cannot be written.
+        unsigned long long write_frames_mmap(const std::string& filename,
+                                             std::size_t num_threads = 0) const;
+
+        // Writes n normal frames drawn uniformly at random, in the order of
+        // their keys and numbered as in the output of write_frames(). The
+        // same seed draws the same frames on any platform. If unique is set,
+        // the frames are drawn without replacement.
+        void write_sampled_frames(std::ostream& os, unsigned long long n,
+                                  unsigned long long seed, bool unique) const;
+
+        // Writes the normal frame with the given key, numbered as in the
+        // output of write_frames(). Returns false if there is no such frame.
+        bool write_frame(std::ostream& os, const std::vector<int>& key) const;
+
+        // Whether the category comes after Expectations, which selects the
+        // first of its choices that can be selected.
+        bool is_expectation_category(std::size_t cat) const;
+
+        // Fills in the choices of the Expectations categories of num_keys
+        // keys, stored one after another, given the choices of the other
+        // categories (-1 for <n/a>). They are selected as in the frames with
+        // those choices, or <n/a> if none can be. The other choices need not
+        // make up a frame of the spec. Large batches are evaluated on all
+        // the cores. Throws std::out_of_range if one is out of range.
+        void evaluate_expectations(int* keys, std::size_t num_keys) const;
+
+        // Reads the keys of the categories other than Expectations (e.g.,
+        // "1.3.0.") one per line and writes the keys of the Expectations
+        // categories for each, one per line. Throws std::runtime_error on an
+        // invalid line.
+        void answer_expectation_queries(std::istream& is,
+                                        std::ostream& os) const;
+
+        // Reads the executed frames and writes the coverage of the choices,
+        // the Expectations outcomes, and the combinations of the choices of
+        // t categories, followed by those not covered. Throws
+        // std::runtime_error on an invalid frame.
+        void write_coverage_report(std::istream& frames, std::ostream& report,
+                                   frame_format format = frame_format::keys,
+                                   std::size_t t = 2) const;
+    };
+
+    // Throws std::runtime_error if the name is unknown or the format is not
+    // supported by this build of the library.
+    compression_format parse_compression_format(const std::string& name);
+
+    // Calls write with a stream compressing what is written to it into os, and
+    // writes the block index to index_os unless it is null (see
+    // etsl_compressed_streambuf.hpp for the format). Throws std::runtime_error
+    // if the output cannot be compressed or written.
+    void write_compressed(std::ostream& os, compression_format format,
+                          std::ostream* index_os,
+                          const std::function<void(std::ostream&)>& write);
+
+    // Serves the requests read from is (see etsl_server.hpp for the protocol)
+    // until the end of the stream, keeping the parsed specs between them.
+    void serve_etsl_requests(std::istream& is, std::ostream& os);
+
+    // Serves the requests from the clients connecting to a Unix socket on
+    // max_clients threads (0 for twice as many as the hardware supports).
+    // The clients connecting while all the threads are busy wait for one to
+    // be free. Never returns unless the socket cannot be opened or accept
+    // connections.
+    void serve_etsl_unix_socket(const std::string& path,
+                                std::size_t max_clients = 0);
+
+    // Sends a request to the server on a Unix socket and writes the payload
+    // of the response to payload_os as it is received. Throws
+    // std::runtime_error with the message of the server on an error
+    // response.
+    void request_etsl_server(const std::string& path,
+                             const std::vector<std::string>& args,
+                             std::ostream& payload_os);
+}
+
+#endif
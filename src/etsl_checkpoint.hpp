@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2017, Yutaka Tsutano
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ETSL_CHECKPOINT_HPP
+#define ETSL_CHECKPOINT_HPP
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <chrono>
+#include <cstdio>
+#include <stdexcept>
+
+#include "etsl.hpp"
+
+namespace etsl {
+    // State of an interrupted run of write_tsl_frames() to an output file.
+    struct etsl_checkpoint {
+        // Hash of the input the frames are generated from.
+        unsigned long long spec_hash = 0;
+
+        frame_order order = frame_order::lexicographic;
+
+        // Size of the output written up to the position.
+        unsigned long long offset = 0;
+
+        etsl_frame_position position;
+    };
+
+    // Writes the checkpoint to a temporary file first and renames it so that
+    // a checkpoint is never left half written.
+    inline void write_checkpoint(const std::string& filename,
+                          const etsl_checkpoint& ckpt)
+    {
+        std::string tmp_filename = filename + ".tmp";
+        {
+            std::ofstream ofs(tmp_filename);
+            ofs << "etsl-checkpoint 1\n";
+            ofs << "spec " << std::hex << ckpt.spec_hash << std::dec << "\n";
+            ofs << "order "
+                << (ckpt.order == frame_order::gray ? "gray" : "lexicographic")
+                << "\n";
+            ofs << "frames " << ckpt.position.frame_num << "\n";
+            ofs << "offset " << ckpt.offset << "\n";
+            ofs << "key ";
+            for (int sel : ckpt.position.key) {
+                ofs << (sel + 1) << ".";
+            }
+            ofs << "\n";
+            ofs << "reversed ";
+            for (bool rev : ckpt.position.reversed) {
+                ofs << (rev ? '1' : '0');
+            }
+            ofs << "\n";
+
+            if (!ofs.flush()) {
+                throw std::runtime_error("cannot write " + tmp_filename);
+            }
+        }
+
+        if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+            throw std::runtime_error("cannot write " + filename);
+        }
+    }
+
+    // Returns false if there is no checkpoint file.
+    inline bool read_checkpoint(const std::string& filename, etsl_checkpoint& ckpt)
+    {
+        std::ifstream ifs(filename);
+        if (!ifs) {
+            return false;
+        }
+
+        auto invalid = [&] {
+            return std::runtime_error("invalid checkpoint " + filename);
+        };
+
+        std::string magic, order, key, reversed;
+        int version;
+        if (!(ifs >> magic >> version) || magic != "etsl-checkpoint"
+            || version != 1) {
+            throw invalid();
+        }
+
+        std::string field;
+        while (ifs >> field) {
+            if (field == "spec") {
+                ifs >> std::hex >> ckpt.spec_hash >> std::dec;
+            }
+            else if (field == "order") {
+                ifs >> order;
+            }
+            else if (field == "frames") {
+                ifs >> ckpt.position.frame_num;
+            }
+            else if (field == "offset") {
+                ifs >> ckpt.offset;
+            }
+            else if (field == "key") {
+                ifs >> key;
+            }
+            else if (field == "reversed") {
+                ifs >> reversed;
+            }
+            else {
+                throw invalid();
+            }
+
+            if (!ifs) {
+                throw invalid();
+            }
+        }
+
+        if (order == "gray") {
+            ckpt.order = frame_order::gray;
+        }
+        else if (order == "lexicographic") {
+            ckpt.order = frame_order::lexicographic;
+        }
+        else {
+            throw invalid();
+        }
+
+        ckpt.position.key = parse_frame_key(key);
+
+        ckpt.position.reversed.clear();
+        for (char c : reversed) {
+            ckpt.position.reversed.push_back(c == '1');
+        }
+
+        return true;
+    }
+
+    namespace details {
+        // Writes checkpoints and reports the progress to stderr as the frames
+        // are written. The output stream is flushed before each checkpoint so
+        // that the checkpoint never points past the data in the output file.
+        class etsl_progress_monitor {
+        private:
+            using clock = std::chrono::steady_clock;
+
+            std::ostream& os_;
+            std::string checkpoint_filename_;
+            etsl_checkpoint ckpt_;
+            bool report_;
+
+            unsigned long long total_frames_;
+            unsigned long long start_frame_num_;
+            clock::time_point start_time_;
+            clock::time_point last_checkpoint_time_;
+            clock::time_point last_report_time_;
+
+        public:
+            // Writes no checkpoints if checkpoint_filename is empty. A
+            // total_frames of 0 means the total is unknown.
+            etsl_progress_monitor(std::ostream& os,
+                                  std::string checkpoint_filename,
+                                  unsigned long long spec_hash,
+                                  frame_order order, bool report,
+                                  unsigned long long total_frames,
+                                  unsigned long long start_frame_num)
+                    : os_(os),
+                      checkpoint_filename_(std::move(checkpoint_filename)),
+                      report_(report),
+                      total_frames_(total_frames),
+                      start_frame_num_(start_frame_num),
+                      start_time_(clock::now()),
+                      last_checkpoint_time_(start_time_),
+                      last_report_time_(start_time_)
+            {
+                ckpt_.spec_hash = spec_hash;
+                ckpt_.order = order;
+            }
+
+            void operator()(const etsl_frame_position& pos)
+            {
+                const auto checkpoint_interval = std::chrono::seconds(10);
+                const auto report_interval = std::chrono::seconds(1);
+
+                auto now = clock::now();
+
+                if (!checkpoint_filename_.empty()
+                    && now - last_checkpoint_time_ >= checkpoint_interval) {
+                    os_.flush();
+                    ckpt_.offset = os_.tellp();
+                    ckpt_.position = pos;
+                    write_checkpoint(checkpoint_filename_, ckpt_);
+                    last_checkpoint_time_ = now;
+                }
+
+                if (report_ && now - last_report_time_ >= report_interval) {
+                    report(pos.frame_num, now);
+                    last_report_time_ = now;
+                }
+            }
+
+            void report(unsigned long long frame_num, clock::time_point now)
+            {
+                double secs = std::chrono::duration<double>(now - start_time_)
+                                      .count();
+                unsigned long long rate
+                        = secs > 0 ? (frame_num - start_frame_num_) / secs : 0;
+
+                std::cerr << "\r" << frame_num;
+                if (total_frames_ != 0) {
+                    std::cerr << " / " << total_frames_;
+                }
+                std::cerr << " frames, " << rate << " frames/s";
+                if (total_frames_ != 0 && rate > 0) {
+                    long remaining = (total_frames_ - frame_num) / rate;
+                    std::cerr << ", " << remaining / 3600 << ":"
+                              << std::setfill('0') << std::setw(2)
+                              << remaining / 60 % 60 << ":" << std::setw(2)
+                              << remaining % 60 << std::setfill(' ')
+                              << " remaining";
+                }
+                std::cerr << "   " << std::flush;
+            }
+
+            // Finishes the progress line after all the frames are written.
+            void finish(unsigned long long frame_num)
+            {
+                if (report_) {
+                    report(frame_num, clock::now());
+                    std::cerr << "\n";
+                }
+            }
+        };
+    }
+}
+
+#endif
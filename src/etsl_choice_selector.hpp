@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) 2017, Yutaka Tsutano
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ETSL_CHOICE_SELECTOR_HPP
+#define ETSL_CHOICE_SELECTOR_HPP
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#include "etsl_plan.hpp"
+
+namespace etsl {
+    namespace details {
+        struct category_choice_state {
+            int selected;
+
+            // Property set of the plan set by the choice (0 for none).
+            std::uint32_t props = 0;
+
+            // Number of consecutive choices from selected that set the same
+            // properties. Only the choices of a range or values category are
+            // collected as runs longer than one.
+            int count = 1;
+        };
+
+        // Selects choices on a plan given the properties set by the choices
+        // selected so far. The choices are selected and deselected level by
+        // level like a stack.
+        //
+        // The value of each predicate node is cached along with the stamp of
+        // the last level it depends on, which changes whenever a choice is
+        // selected at that level. The node is evaluated again only when the
+        // choices up to that level may have changed.
+        class etsl_choice_selector {
+        private:
+            using node = etsl_plan::node;
+
+            const etsl_plan& plan_;
+
+            // Number of selected choices currently setting each property.
+            std::vector<int> prop_refs_;
+
+            // Stamp of the choice selected at each level, offset by one so
+            // that stamps_[0] stands for no level, and the number of levels
+            // selected.
+            std::vector<std::uint64_t> stamps_;
+            std::uint64_t clock_ = 0;
+            size_t depth_ = 0;
+
+            std::vector<std::uint64_t> node_stamps_;
+            std::vector<char> node_values_;
+
+        private:
+            // Evaluates the node given the choices selected before the
+            // level.
+            bool evaluate(std::uint32_t n, size_t level)
+            {
+                const auto& nd = plan_.nodes[n];
+                if (nd.op == node::prop) {
+                    return prop_refs_[nd.first] > 0;
+                }
+
+                auto stamp = stamps_[std::min<size_t>(nd.level + 1, level)];
+                if (node_stamps_[n] == stamp) {
+                    return node_values_[n];
+                }
+
+                bool value;
+                if (nd.op == node::op_not) {
+                    value = !evaluate(plan_.node_operands[nd.first], level);
+                }
+                else {
+                    // Stop at the first operand that decides the value.
+                    value = nd.op == node::op_and;
+                    for (auto i = nd.first; i < nd.last; ++i) {
+                        if (evaluate(plan_.node_operands[i], level) != value) {
+                            value = !value;
+                            break;
+                        }
+                    }
+                }
+
+                node_stamps_[n] = stamp;
+                node_values_[n] = value;
+                return value;
+            }
+
+        public:
+            explicit etsl_choice_selector(const etsl_plan& plan)
+                    : plan_(plan),
+                      prop_refs_(plan.num_props(), 0),
+                      stamps_(plan.num_categories() + 1, 0),
+                      node_stamps_(plan.nodes.size(), ~std::uint64_t(0)),
+                      node_values_(plan.nodes.size(), 0)
+            {
+            }
+
+            bool has_prop(std::uint32_t id) const
+            {
+                return prop_refs_[id] > 0;
+            }
+
+            // Selects the choice at the level after the last one selected.
+            void select(const category_choice_state& st)
+            {
+                stamps_[++depth_] = ++clock_;
+                for (auto i = plan_.prop_set_begin[st.props];
+                     i < plan_.prop_set_begin[st.props + 1]; ++i) {
+                    ++prop_refs_[plan_.prop_set_ids[i]];
+                }
+            }
+
+            void deselect(const category_choice_state& st)
+            {
+                --depth_;
+                for (auto i = plan_.prop_set_begin[st.props];
+                     i < plan_.prop_set_begin[st.props + 1]; ++i) {
+                    --prop_refs_[plan_.prop_set_ids[i]];
+                }
+            }
+
+            // Returns the state of the choice (-1 for <n/a>) of the category
+            // at the level given the choices selected before it, whether or
+            // not the choice can be selected.
+            category_choice_state choice_state(size_t level, int choice)
+            {
+                category_choice_state st;
+                st.selected = choice;
+                if (choice < 0) {
+                    return st;
+                }
+
+                // Find the value class of a range or values category.
+                const auto first = plan_.class_begin[level];
+                const auto last = plan_.class_begin[level + 1];
+                if (first != last) {
+                    auto it = std::upper_bound(
+                            begin(plan_.class_first) + first,
+                            begin(plan_.class_first) + last, choice);
+                    st.props = plan_.class_props[it - begin(plan_.class_first)
+                                                 - 1];
+                    return st;
+                }
+
+                auto i = plan_.choice_begin[level] + choice;
+                if (!(plan_.choice_flags[i] & etsl_plan::choice_has_if)
+                    || evaluate(plan_.choice_cond[i], level)) {
+                    st.props = plan_.choice_if_props[i];
+                }
+                else {
+                    st.props = plan_.choice_else_props[i];
+                }
+                return st;
+            }
+
+            // Collects the choices of the category at the level that can be
+            // selected, in the order they appear in the category. Only the
+            // first one is collected for a mutually exclusive category. If
+            // none is selectable, or the guard of the category does not
+            // hold, <n/a> (selected == -1) is collected instead. The choices
+            // of a range or values category, which are otherwise always
+            // selectable, are collected as one run per value class.
+            void select_choices(size_t level,
+                                std::vector<category_choice_state>& selection)
+            {
+                selection.clear();
+
+                if ((plan_.category_flags[level]
+                     & etsl_plan::category_has_guard)
+                    && !evaluate(plan_.category_guard[level], level)) {
+                    selection.emplace_back();
+                    selection.back().selected = -1;
+                    return;
+                }
+
+                for (auto k = plan_.class_begin[level];
+                     k < plan_.class_begin[level + 1]; ++k) {
+                    selection.emplace_back();
+                    selection.back().selected = plan_.class_first[k];
+                    selection.back().props = plan_.class_props[k];
+                    selection.back().count = plan_.class_count[k];
+                }
+
+                const auto first = plan_.choice_begin[level];
+                const auto last = plan_.choice_begin[level + 1];
+                for (auto i = first; i < last; ++i) {
+                    auto flags = plan_.choice_flags[i];
+
+                    bool selectable;
+                    std::uint32_t props;
+                    if (!(flags & etsl_plan::choice_has_if)) {
+                        selectable = flags & etsl_plan::choice_selectable;
+                        props = plan_.choice_if_props[i];
+                    }
+                    else if (evaluate(plan_.choice_cond[i], level)) {
+                        selectable = flags & etsl_plan::choice_if_selectable;
+                        props = plan_.choice_if_props[i];
+                    }
+                    else {
+                        selectable = (flags & etsl_plan::choice_has_else)
+                                && (flags & etsl_plan::choice_else_selectable);
+                        props = plan_.choice_else_props[i];
+                    }
+
+                    if (selectable) {
+                        selection.emplace_back();
+                        selection.back().selected = i - first;
+                        selection.back().props = props;
+
+                        if (plan_.category_flags[level]
+                            & etsl_plan::category_mutually_exclusive) {
+                            break;
+                        }
+                    }
+                }
+
+                // If none is selected for this category, we need to select N/A.
+                if (selection.empty()) {
+                    selection.emplace_back();
+                    selection.back().selected = -1;
+                    selection.back().props = 0;
+                }
+            }
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2017, Yutaka Tsutano
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ETSL_COMPRESSED_STREAMBUF_HPP
+#define ETSL_COMPRESSED_STREAMBUF_HPP
+
+// Block index
+// ===========
+//
+// The compressed output is a sequence of independently compressed blocks:
+// gzip members or zstd frames, either of which can be decompressed by the
+// usual tools as a whole. Each block but the first starts at a frame heading
+// when possible, and the index lists such blocks so that a frame can be found
+// by decompressing from the block at or before it:
+//
+//     etsl-index 1
+//     format gzip|zstd
+//     block frame_num compressed_offset uncompressed_offset
+//     ...
+//
+// frame_num is the Test Case number of the first frame in the block.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <future>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <stdexcept>
+
+#ifdef ETSL_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef ETSL_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "etsl.hpp"
+#include "etsl_thread_pool.hpp"
+
+namespace etsl {
+    namespace details {
+        inline std::string compress_block(const std::string& input,
+                                          compression_format format)
+        {
+            std::string output;
+            if (format == compression_format::gzip) {
+#ifdef ETSL_HAVE_ZLIB
+                // Each block is a complete gzip member.
+                z_stream zs = {};
+                if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                                 15 + 16, 8, Z_DEFAULT_STRATEGY)
+                    != Z_OK) {
+                    throw std::runtime_error("cannot compress");
+                }
+                output.resize(deflateBound(&zs, input.size()));
+                zs.next_in = reinterpret_cast<Bytef*>(
+                        const_cast<char*>(input.data()));
+                zs.avail_in = input.size();
+                zs.next_out = reinterpret_cast<Bytef*>(&output[0]);
+                zs.avail_out = output.size();
+                int ret = deflate(&zs, Z_FINISH);
+                output.resize(zs.total_out);
+                deflateEnd(&zs);
+                if (ret != Z_STREAM_END) {
+                    throw std::runtime_error("cannot compress");
+                }
+#endif
+            }
+            else {
+#ifdef ETSL_HAVE_ZSTD
+                output.resize(ZSTD_compressBound(input.size()));
+                size_t n = ZSTD_compress(&output[0], output.size(),
+                                         input.data(), input.size(), 3);
+                if (ZSTD_isError(n)) {
+                    throw std::runtime_error("cannot compress");
+                }
+                output.resize(n);
+#endif
+            }
+            return output;
+        }
+    }
+
+    // Stream buffer compressing blocks of the output on a thread pool and
+    // writing them in order to the underlying stream. finish() must be
+    // called after the last write.
+    class etsl_compressed_streambuf : public std::streambuf {
+    private:
+        struct block {
+            std::string input;
+            std::string output;
+            unsigned long long frame_num;
+            std::future<void> done;
+        };
+
+        std::ostream& os_;
+        std::ostream* index_os_;
+        compression_format format_;
+        etsl_thread_pool pool_;
+
+        std::vector<char> buf_;
+        std::deque<std::shared_ptr<block>> pending_;
+        unsigned long long compressed_size_ = 0;
+        unsigned long long uncompressed_size_ = 0;
+
+    private:
+        static const char* frame_heading()
+        {
+            return "\nTest Case ";
+        }
+
+        // Returns the Test Case number if the data starts with a frame
+        // heading, or 0 otherwise.
+        static unsigned long long parse_frame_num(const std::string& data)
+        {
+            size_t len = std::strlen(frame_heading());
+            if (data.compare(0, len, frame_heading()) != 0) {
+                return 0;
+            }
+            return std::strtoull(data.c_str() + len, nullptr, 10);
+        }
+
+        void write_front()
+        {
+            auto b = pending_.front();
+            pending_.pop_front();
+            b->done.get();
+
+            if (b->frame_num != 0 && index_os_ != nullptr) {
+                *index_os_ << "block " << b->frame_num << " "
+                           << compressed_size_ << " " << uncompressed_size_
+                           << "\n";
+            }
+            os_.write(b->output.data(), b->output.size());
+            compressed_size_ += b->output.size();
+            uncompressed_size_ += b->input.size();
+        }
+
+        void submit(size_t size)
+        {
+            if (size == 0) {
+                return;
+            }
+
+            auto b = std::make_shared<block>();
+            b->input.assign(pbase(), size);
+            b->frame_num = parse_frame_num(b->input);
+
+            // Move the rest to the next block.
+            size_t rest = pptr() - pbase() - size;
+            std::memmove(buf_.data(), pbase() + size, rest);
+            setp(buf_.data(), buf_.data() + buf_.size());
+            pbump(rest);
+
+            auto format = format_;
+            auto task = std::make_shared<std::packaged_task<void()>>(
+                    [b, format] {
+                        b->output = details::compress_block(b->input, format);
+                    });
+            b->done = task->get_future();
+            pending_.push_back(b);
+            pool_.submit([task] { (*task)(); });
+
+            // Keep the memory held by the blocks bounded.
+            while (pending_.size() > 2 * pool_.size()) {
+                write_front();
+            }
+        }
+
+    protected:
+        int_type overflow(int_type c) override
+        {
+            // Cut the block before the last frame heading in its second half
+            // so that the next block starts at a frame.
+            size_t size = pptr() - pbase();
+            size_t len = std::strlen(frame_heading());
+            size_t cut = size;
+            for (size_t i = size - std::min(size, len); i >= size / 2 && i > 0;
+                 --i) {
+                if (std::memcmp(pbase() + i, frame_heading(), len) == 0) {
+                    cut = i;
+                    break;
+                }
+            }
+            submit(cut);
+
+            if (!traits_type::eq_int_type(c, traits_type::eof())) {
+                *pptr() = traits_type::to_char_type(c);
+                pbump(1);
+            }
+            return traits_type::not_eof(c);
+        }
+
+    public:
+        // Writes the block index to index_os unless it is null.
+        etsl_compressed_streambuf(std::ostream& os, compression_format format,
+                                  std::ostream* index_os = nullptr,
+                                  size_t num_threads = 0,
+                                  size_t block_size = 1 << 20)
+                : os_(os),
+                  index_os_(index_os),
+                  format_(format),
+                  pool_(num_threads),
+                  buf_(block_size)
+        {
+            setp(buf_.data(), buf_.data() + buf_.size());
+            if (index_os_ != nullptr) {
+                *index_os_ << "etsl-index 1\n"
+                           << "format "
+                           << (format == compression_format::gzip ? "gzip"
+                                                                  : "zstd")
+                           << "\n";
+            }
+        }
+
+        ~etsl_compressed_streambuf()
+        {
+            // Let the tasks finish before the blocks are destroyed.
+            pool_.wait();
+        }
+
+        // Compresses and writes the rest of the output. Throws
+        // std::runtime_error if a block cannot be compressed.
+        void finish()
+        {
+            submit(pptr() - pbase());
+            while (!pending_.empty()) {
+                write_front();
+            }
+            os_.flush();
+        }
+    };
+}
+
+#endif
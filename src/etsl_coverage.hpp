@@ -0,0 +1,614 @@
+/*
+ * Copyright (c) 2017, Yutaka Tsutano
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ETSL_COVERAGE_HPP
+#define ETSL_COVERAGE_HPP
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <algorithm>
+#include <stdexcept>
+
+#include "etsl_file.hpp"
+#include "etsl_delta_stream.hpp"
+#include "etsl_choice_selector.hpp"
+
+namespace etsl {
+    namespace details {
+        // Set of the combinations of the choices of t categories, one bitmap
+        // per set of t categories. The choices of a range or values category
+        // are represented by their value classes, and <n/a> by slot 0.
+        class etsl_coverage_bitmap {
+        private:
+            size_t t_;
+            std::vector<size_t> radixes_;
+
+            // binomials_[c * (t + 1) + k] is c choose k.
+            std::vector<std::uint64_t> binomials_;
+
+            // Bit offset of the bitmap of each set of t categories, by the
+            // rank of the set in colexicographic order.
+            std::vector<std::uint64_t> offsets_;
+            std::vector<std::uint64_t> bits_;
+
+            std::vector<size_t> tuple_;
+
+        private:
+            std::uint64_t binomial(size_t n, size_t k) const
+            {
+                return binomials_[n * (t_ + 1) + k];
+            }
+
+            std::uint64_t rank(const std::vector<size_t>& tuple) const
+            {
+                std::uint64_t r = 0;
+                for (size_t k = 0; k < t_; ++k) {
+                    r += binomial(tuple[k], k + 1);
+                }
+                return r;
+            }
+
+            // Sets the bits of the tuples made of the categories chosen so
+            // far, whose rank and index are partially summed, and t - k more
+            // categories from start on that include category d.
+            void set_tuples(size_t k, size_t start, size_t d, bool has_d,
+                            std::uint64_t rank, std::uint64_t index,
+                            const int* slots)
+            {
+                if (k == t_) {
+                    auto b = offsets_[rank] + index;
+                    bits_[b / 64] |= std::uint64_t(1) << (b % 64);
+                    return;
+                }
+                for (size_t c = start; c + (t_ - k) <= radixes_.size(); ++c) {
+                    if (!has_d) {
+                        if (c > d) {
+                            break;
+                        }
+                        if (k + 1 == t_) {
+                            c = d;
+                        }
+                    }
+                    set_tuples(k + 1, c + 1, d, has_d || c == d,
+                               rank + binomial(c, k + 1),
+                               index * radixes_[c] + slots[c], slots);
+                }
+            }
+
+            template <typename F>
+            void visit_tuples(size_t k, size_t start, const F& f)
+            {
+                if (k == t_) {
+                    f(tuple_);
+                    return;
+                }
+                for (size_t c = start; c + (t_ - k) <= radixes_.size(); ++c) {
+                    tuple_[k] = c;
+                    visit_tuples(k + 1, c + 1, f);
+                }
+            }
+
+        public:
+            // Throws std::runtime_error if the bitmaps would be too large.
+            etsl_coverage_bitmap(size_t t, std::vector<size_t> radixes)
+                    : t_(t), radixes_(std::move(radixes)), tuple_(t)
+            {
+                const size_t n = radixes_.size();
+                const std::uint64_t max_bits = std::uint64_t(1) << 34;
+
+                binomials_.assign((n + 1) * (t_ + 1), 0);
+                for (size_t c = 0; c <= n; ++c) {
+                    binomials_[c * (t_ + 1)] = 1;
+                    for (size_t k = 1; k <= t_ && c > 0; ++k) {
+                        binomials_[c * (t_ + 1) + k]
+                                = binomial(c - 1, k - 1) + binomial(c - 1, k);
+                        if (binomials_[c * (t_ + 1) + k] > max_bits) {
+                            throw std::runtime_error(
+                                    "too many combinations for "
+                                    + std::to_string(t_) + "-way coverage");
+                        }
+                    }
+                }
+
+                offsets_.resize(binomial(n, t_) + 1, 0);
+                std::uint64_t total = 0;
+                visit_tuples(0, 0, [&](const std::vector<size_t>& tuple) {
+                    std::uint64_t size = 1;
+                    for (auto c : tuple) {
+                        size *= radixes_[c];
+                        if (size > max_bits) {
+                            break;
+                        }
+                    }
+                    total += size;
+                    if (size > max_bits || total > max_bits) {
+                        throw std::runtime_error(
+                                "too many combinations for "
+                                + std::to_string(t_) + "-way coverage");
+                    }
+                    offsets_[rank(tuple) + 1] = size;
+                });
+                for (size_t i = 1; i < offsets_.size(); ++i) {
+                    offsets_[i] += offsets_[i - 1];
+                }
+                bits_.assign((total + 63) / 64, 0);
+            }
+
+            // Adds the combinations of the slots of each category, given
+            // that only those of the changed categories may differ from the
+            // slots added last.
+            void add(const int* slots, const std::vector<size_t>& changed)
+            {
+                if (changed.size() == radixes_.size()) {
+                    set_tuples(0, 0, 0, true, 0, 0, slots);
+                    return;
+                }
+                for (auto d : changed) {
+                    set_tuples(0, 0, d, false, 0, 0, slots);
+                }
+            }
+
+            // Adds all the combinations.
+            void fill()
+            {
+                std::fill(begin(bits_), end(bits_), ~std::uint64_t(0));
+            }
+
+            // Calls f(tuple, slots, in_this, in_other) for each combination
+            // in this or the other bitmap of the same shape.
+            template <typename F>
+            void visit(const etsl_coverage_bitmap& other, const F& f)
+            {
+                std::vector<int> slots(radixes_.size());
+                visit_tuples(0, 0, [&](const std::vector<size_t>& tuple) {
+                    auto first = offsets_[rank(tuple)];
+                    auto last = offsets_[rank(tuple) + 1];
+                    for (auto b = first; b < last; ++b) {
+                        bool in_this = (bits_[b / 64] >> (b % 64)) & 1;
+                        bool in_other = (other.bits_[b / 64] >> (b % 64)) & 1;
+                        if (!in_this && !in_other) {
+                            continue;
+                        }
+                        auto index = b - first;
+                        for (size_t k = t_; k-- > 0;) {
+                            slots[tuple[k]] = index % radixes_[tuple[k]];
+                            index /= radixes_[tuple[k]];
+                        }
+                        f(tuple, slots, in_this, in_other);
+                    }
+                });
+            }
+        };
+    }
+
+    // Coverage of the choices, the Expectations outcomes, and the
+    // combinations of the choices of t categories by executed frames,
+    // measured against the combinations the normal frames of the spec
+    // contain. The memory used does not depend on the number of frames.
+    class etsl_coverage {
+    private:
+        const etsl_file& file_;
+        size_t t_;
+        std::vector<size_t> radixes_;
+
+        details::etsl_coverage_bitmap executed_choices_;
+        details::etsl_coverage_bitmap feasible_choices_;
+        std::vector<details::etsl_coverage_bitmap> executed_tuples_;
+        std::vector<details::etsl_coverage_bitmap> feasible_tuples_;
+
+        // Whether the feasible combinations were found by enumerating the
+        // frames. If there are too many, all the combinations are counted.
+        bool feasible_known_ = false;
+
+        unsigned long long num_frames_ = 0;
+        std::vector<int> slots_;
+        std::vector<int> last_slots_;
+        std::vector<size_t> changed_;
+
+    private:
+        static std::vector<size_t> slot_radixes(const etsl_file& file)
+        {
+            std::vector<size_t> radixes;
+            for (const auto& cat : file.categories) {
+                radixes.push_back(1
+                                  + (cat.has_domain() ? cat.domain.classes.size()
+                                                      : cat.choices.size()));
+            }
+            return radixes;
+        }
+
+        bool is_outcome(size_t cat) const
+        {
+            return file_.categories[cat].mutually_exclusive;
+        }
+
+        int slot(size_t cat, int choice) const
+        {
+            if (choice < 0) {
+                return 0;
+            }
+            const auto& category = file_.categories[cat];
+            return 1
+                    + (category.has_domain()
+                               ? static_cast<int>(
+                                         category.domain.class_of(choice))
+                               : choice);
+        }
+
+        std::string slot_name(size_t cat, int slot) const
+        {
+            const auto& category = file_.categories[cat];
+            if (slot == 0) {
+                return "<n/a>";
+            }
+            if (!category.has_domain()) {
+                return category.choices[slot - 1].name;
+            }
+
+            // Name a value class by its first and last values.
+            const auto& vc = category.domain.classes[slot - 1];
+            if (vc.last - vc.first == 1) {
+                return category.domain.name(vc.first);
+            }
+            return category.domain.name(vc.first) + ".."
+                    + category.domain.name(vc.last - 1);
+        }
+
+        void add_slots(const int* slots)
+        {
+            changed_.clear();
+            for (size_t i = 0; i < radixes_.size(); ++i) {
+                if (num_frames_ == 0 || slots[i] != last_slots_[i]) {
+                    changed_.push_back(i);
+                    last_slots_[i] = slots[i];
+                }
+            }
+            ++num_frames_;
+            if (changed_.empty()) {
+                return;
+            }
+
+            executed_choices_.add(slots, changed_);
+            if (!executed_tuples_.empty()) {
+                executed_tuples_[0].add(slots, changed_);
+            }
+        }
+
+        // Visits the normal frames with the choices of range and values
+        // categories collapsed to their value classes, which is enough to
+        // find the feasible combinations. Returns false if there are more
+        // than max_frames.
+        bool find_feasible(unsigned long long max_frames)
+        {
+            const auto& plan = file_.plan;
+            details::etsl_choice_selector selector(plan);
+            std::vector<std::vector<details::category_choice_state>>
+                    selections(radixes_.size());
+            std::vector<int> slots(radixes_.size());
+            std::vector<size_t> changed;
+            unsigned long long num_frames = 0;
+            bool first = true;
+            size_t min_changed = 0;
+
+            std::function<bool(size_t)> visit = [&](size_t level) {
+                if (level == radixes_.size()) {
+                    if (++num_frames > max_frames) {
+                        return false;
+                    }
+
+                    // Only the levels from the shallowest one selected again
+                    // since the last frame may have changed.
+                    changed.clear();
+                    for (size_t i = first ? 0 : min_changed;
+                         i < radixes_.size(); ++i) {
+                        changed.push_back(i);
+                    }
+                    first = false;
+                    min_changed = radixes_.size();
+
+                    feasible_choices_.add(slots.data(), changed);
+                    if (!feasible_tuples_.empty()) {
+                        feasible_tuples_[0].add(slots.data(), changed);
+                    }
+                    return true;
+                }
+
+                auto& selection = selections[level];
+                selector.select_choices(level, selection);
+                for (const auto& st : selection) {
+                    slots[level] = slot(level, st.selected);
+                    min_changed = std::min(min_changed, level);
+                    selector.select(st);
+                    bool ok = visit(level + 1);
+                    selector.deselect(st);
+                    if (!ok) {
+                        return false;
+                    }
+                }
+                return true;
+            };
+            return visit(0);
+        }
+
+        void write_summary(std::ostream& os, const std::string& what,
+                           unsigned long long covered,
+                           unsigned long long total) const
+        {
+            os << what << " covered: " << covered << " of " << total;
+            if (total != 0) {
+                os << " (" << std::fixed << std::setprecision(1)
+                   << 100.0 * covered / total << "%)";
+            }
+            os << "\n";
+        }
+
+    public:
+        // Frames of specs with more than max_frames normal frames (counting
+        // the values of a class once) are not enumerated to find the
+        // feasible combinations. Throws std::runtime_error if the bitmaps
+        // would be too large.
+        etsl_coverage(const etsl_file& file, size_t t,
+                      unsigned long long max_frames = 10000000)
+                : file_(file),
+                  t_(t),
+                  radixes_(slot_radixes(file)),
+                  executed_choices_(1, radixes_),
+                  feasible_choices_(1, radixes_),
+                  slots_(radixes_.size()),
+                  last_slots_(radixes_.size())
+        {
+            if (t_ >= 2 && t_ <= radixes_.size()) {
+                executed_tuples_.emplace_back(t_, radixes_);
+                feasible_tuples_.emplace_back(t_, radixes_);
+            }
+
+            feasible_known_ = find_feasible(max_frames);
+            if (!feasible_known_) {
+                feasible_choices_.fill();
+                for (auto& b : feasible_tuples_) {
+                    b.fill();
+                }
+            }
+        }
+
+        // Adds an executed frame given the selected choice of each category
+        // (-1 for <n/a>). Throws std::out_of_range if a choice is out of
+        // range.
+        void add(const int* key)
+        {
+            for (size_t i = 0; i < radixes_.size(); ++i) {
+                if (key[i] < -1
+                    || key[i] >= static_cast<int>(
+                               file_.categories[i].num_choices())) {
+                    throw std::out_of_range("choice out of range");
+                }
+                slots_[i] = slot(i, key[i]);
+            }
+            add_slots(slots_.data());
+        }
+
+        // Adds the executed frames read from the stream: their keys one per
+        // line (e.g., "1.3.0."), or frames as written by etsl, whose lines
+        // other than the frame headings are skipped. Throws
+        // std::runtime_error on an invalid key.
+        void add_frames(std::istream& is)
+        {
+            const std::string key_prefix = "(Key = ";
+            std::vector<int> key(radixes_.size());
+            std::string line;
+            unsigned long long line_num = 0;
+            while (std::getline(is, line)) {
+                ++line_num;
+                size_t first = line.find(key_prefix);
+                size_t last;
+                if (first != std::string::npos) {
+                    first += key_prefix.size();
+                    last = line.find(')', first);
+                }
+                else if (!line.empty() && line[0] >= '0' && line[0] <= '9') {
+                    first = 0;
+                    last = line.find_last_not_of(" \t\r") + 1;
+                }
+                else {
+                    continue;
+                }
+
+                size_t i = 0;
+                int n = 0;
+                bool has_digit = false;
+                bool valid = last != std::string::npos;
+                for (size_t p = first; valid && p < last; ++p) {
+                    char c = line[p];
+                    if (c >= '0' && c <= '9' && n < (1 << 30) / 10) {
+                        n = n * 10 + (c - '0');
+                        has_digit = true;
+                    }
+                    else if (c == '.' && has_digit && i < key.size()) {
+                        key[i++] = n - 1;
+                        n = 0;
+                        has_digit = false;
+                    }
+                    else {
+                        valid = false;
+                    }
+                }
+                try {
+                    if (!valid || has_digit || i != key.size()) {
+                        throw std::out_of_range("invalid key");
+                    }
+                    add(key.data());
+                }
+                catch (std::out_of_range&) {
+                    throw std::runtime_error("invalid key on line "
+                                             + std::to_string(line_num));
+                }
+            }
+        }
+
+        // Adds the executed frames read from the stream as records of one
+        // little-endian 32-bit integer per category: the selected choice
+        // (-1 for <n/a>). Throws std::runtime_error on an invalid record.
+        void add_frame_records(std::istream& is)
+        {
+            const size_t record_size = 4 * radixes_.size();
+            std::vector<unsigned char> buf(record_size * 4096);
+            std::vector<int> key(radixes_.size());
+            size_t pending = 0;
+            while (is) {
+                is.read(reinterpret_cast<char*>(buf.data()) + pending,
+                        buf.size() - pending);
+                size_t size = pending + is.gcount();
+                size_t p = 0;
+                for (; p + record_size <= size && record_size != 0;
+                     p += record_size) {
+                    for (size_t i = 0; i < key.size(); ++i) {
+                        const unsigned char* b = &buf[p + 4 * i];
+                        key[i] = static_cast<std::int32_t>(
+                                std::uint32_t(b[0]) | std::uint32_t(b[1]) << 8
+                                | std::uint32_t(b[2]) << 16
+                                | std::uint32_t(b[3]) << 24);
+                    }
+                    try {
+                        add(key.data());
+                    }
+                    catch (std::out_of_range&) {
+                        throw std::runtime_error(
+                                "invalid record "
+                                + std::to_string(num_frames_ + 1));
+                    }
+                }
+                pending = size - p;
+                std::copy(buf.begin() + p, buf.begin() + size, buf.begin());
+            }
+            if (pending != 0) {
+                throw std::runtime_error("truncated record");
+            }
+        }
+
+        // Adds the frames of a delta stream written for the same spec.
+        void add_delta_frames(std::istream& is)
+        {
+            etsl_delta_reader reader(is);
+            bool matches = reader.num_categories() == radixes_.size();
+            for (size_t i = 0; matches && i < radixes_.size(); ++i) {
+                matches = reader.num_choices(i)
+                        == file_.categories[i].num_choices();
+            }
+            if (!matches) {
+                throw std::runtime_error(
+                        "delta stream does not match the spec");
+            }
+
+            etsl_frame frame;
+            while (reader.next(frame)) {
+                add(frame.key.data());
+            }
+        }
+
+        unsigned long long num_frames() const
+        {
+            return num_frames_;
+        }
+
+        // Writes the coverage and the feasible combinations not covered.
+        void write_report(std::ostream& os)
+        {
+            // Count first, and then list the uncovered combinations without
+            // holding them.
+            unsigned long long choices[2] = {0, 0};
+            unsigned long long outcomes[2] = {0, 0};
+            executed_choices_.visit(
+                    feasible_choices_,
+                    [&](const std::vector<size_t>& tuple,
+                        const std::vector<int>&, bool executed, bool feasible) {
+                        if (feasible) {
+                            auto& counts = is_outcome(tuple[0]) ? outcomes
+                                                                : choices;
+                            counts[0] += executed;
+                            ++counts[1];
+                        }
+                    });
+
+            unsigned long long tuples[2] = {0, 0};
+            for (size_t i = 0; i < executed_tuples_.size(); ++i) {
+                executed_tuples_[i].visit(
+                        feasible_tuples_[i],
+                        [&](const std::vector<size_t>&,
+                            const std::vector<int>&, bool executed,
+                            bool feasible) {
+                            if (feasible) {
+                                tuples[0] += executed;
+                                ++tuples[1];
+                            }
+                        });
+            }
+
+            os << "Frames: " << num_frames_ << "\n";
+            write_summary(os, "Choices", choices[0], choices[1]);
+            write_summary(os, "Expectations outcomes", outcomes[0],
+                          outcomes[1]);
+            if (!executed_tuples_.empty()) {
+                write_summary(os, std::to_string(t_) + "-way combinations",
+                              tuples[0], tuples[1]);
+            }
+            if (!feasible_known_) {
+                os << "(Too many frames to find the feasible combinations; "
+                      "all the combinations are counted.)\n";
+            }
+
+            auto write_uncovered = [&](details::etsl_coverage_bitmap& executed,
+                                       details::etsl_coverage_bitmap& feasible,
+                                       const std::string& title,
+                                       int outcome) {
+                bool any = false;
+                executed.visit(feasible, [&](const std::vector<size_t>& tuple,
+                                             const std::vector<int>& slots,
+                                             bool is_executed,
+                                             bool is_feasible) {
+                    if (is_executed || !is_feasible
+                        || (outcome >= 0
+                            && is_outcome(tuple[0]) != (outcome != 0))) {
+                        return;
+                    }
+                    if (!any) {
+                        os << "\nUncovered " << title << ":\n";
+                        any = true;
+                    }
+                    os << "  ";
+                    for (size_t k = 0; k < tuple.size(); ++k) {
+                        os << (k == 0 ? " " : ", ")
+                           << file_.categories[tuple[k]].name << " :  "
+                           << slot_name(tuple[k], slots[tuple[k]]);
+                    }
+                    os << "\n";
+                });
+            };
+            write_uncovered(executed_choices_, feasible_choices_, "choices", 0);
+            write_uncovered(executed_choices_, feasible_choices_,
+                            "Expectations outcomes", 1);
+            for (size_t i = 0; i < executed_tuples_.size(); ++i) {
+                write_uncovered(executed_tuples_[i], feasible_tuples_[i],
+                                std::to_string(t_) + "-way combinations", -1);
+            }
+        }
+    };
+}
+
+#endif
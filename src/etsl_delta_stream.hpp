@@ -0,0 +1,359 @@
+/*
+ * Copyright (c) 2017, Yutaka Tsutano
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ETSL_DELTA_STREAM_HPP
+#define ETSL_DELTA_STREAM_HPP
+
+// Delta stream
+// ============
+//
+// Compact binary form of the keys of the normal frames, in which each frame
+// only holds the choices from the first category that differs from the frame
+// before it. All the numbers are unsigned LEB128 varints, and a choice is
+// written as its index plus one (0 for <n/a>).
+//
+//     "ETSLDELTA1\n"
+//     keyframe_interval num_categories
+//     (name_length name num_choices) for each category
+//
+// followed by segments of keyframe_interval frames (fewer in the last one):
+//
+//     num_categories segment_size frame_num choice...
+//     (first choice...) for each following frame
+//
+// A segment starts with a keyframe holding the Test Case number and all the
+// choices of its frame. segment_size is the number of bytes after frame_num
+// up to the next segment, so that a reader can skip whole segments. Each
+// following frame is numbered one after the frame before it and holds the
+// choices of the categories from first (< num_categories) on.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <stdexcept>
+
+#include "etsl.hpp"
+
+namespace etsl {
+    namespace details {
+        inline void write_varint(std::string& out, unsigned long long n)
+        {
+            while (n >= 0x80) {
+                out.push_back(static_cast<char>((n & 0x7f) | 0x80));
+                n >>= 7;
+            }
+            out.push_back(static_cast<char>(n));
+        }
+
+        inline const char* delta_stream_magic()
+        {
+            return "ETSLDELTA1\n";
+        }
+    }
+
+    // Writes the keys of frames as a delta stream. finish() must be called
+    // after the last frame.
+    class etsl_delta_writer {
+    private:
+        std::ostream& os_;
+        size_t num_categories_;
+        unsigned long long keyframe_interval_;
+
+        // Keyframe and the rest of the segment being written.
+        unsigned long long keyframe_num_ = 0;
+        std::string keyframe_;
+        std::string segment_;
+        unsigned long long segment_frames_ = 0;
+
+        std::vector<int> last_key_;
+
+    private:
+        void flush_segment()
+        {
+            if (segment_frames_ == 0) {
+                return;
+            }
+
+            std::string head;
+            details::write_varint(head, num_categories_);
+            details::write_varint(head, keyframe_.size() + segment_.size());
+            details::write_varint(head, keyframe_num_);
+            os_.write(head.data(), head.size());
+            os_.write(keyframe_.data(), keyframe_.size());
+            os_.write(segment_.data(), segment_.size());
+
+            keyframe_.clear();
+            segment_.clear();
+            segment_frames_ = 0;
+        }
+
+    public:
+        // Writes the header. A keyframe is written every keyframe_interval
+        // frames.
+        etsl_delta_writer(std::ostream& os,
+                          const std::vector<std::string>& category_names,
+                          const std::vector<std::size_t>& num_choices,
+                          unsigned long long keyframe_interval = 4096)
+                : os_(os),
+                  num_categories_(category_names.size()),
+                  keyframe_interval_(keyframe_interval),
+                  last_key_(category_names.size())
+        {
+            // Without categories, there is no delta to write.
+            if (num_categories_ == 0 || keyframe_interval_ == 0) {
+                keyframe_interval_ = 1;
+            }
+
+            std::string head = details::delta_stream_magic();
+            details::write_varint(head, keyframe_interval_);
+            details::write_varint(head, num_categories_);
+            for (size_t i = 0; i < num_categories_; ++i) {
+                details::write_varint(head, category_names[i].size());
+                head += category_names[i];
+                details::write_varint(head, num_choices[i]);
+            }
+            os_.write(head.data(), head.size());
+        }
+
+        // Writes the frame with the Test Case number and the selected choice
+        // of each category (-1 for <n/a>). The frames of a segment must be
+        // numbered consecutively.
+        void write(unsigned long long frame_num, const int* key)
+        {
+            if (segment_frames_ == keyframe_interval_) {
+                flush_segment();
+            }
+
+            if (segment_frames_ == 0) {
+                keyframe_num_ = frame_num;
+                for (size_t i = 0; i < num_categories_; ++i) {
+                    details::write_varint(keyframe_, key[i] + 1);
+                }
+            }
+            else {
+                // Repeat the last choice of a frame with the same key.
+                size_t first = 0;
+                while (first + 1 < num_categories_
+                       && key[first] == last_key_[first]) {
+                    ++first;
+                }
+                details::write_varint(segment_, first);
+                for (size_t i = first; i < num_categories_; ++i) {
+                    details::write_varint(segment_, key[i] + 1);
+                }
+            }
+
+            last_key_.assign(key, key + num_categories_);
+            ++segment_frames_;
+        }
+
+        void finish()
+        {
+            flush_segment();
+            os_.flush();
+        }
+    };
+
+    // Reads the frames of a delta stream. Throws std::runtime_error if the
+    // stream is not a valid delta stream.
+    class etsl_delta_reader {
+    private:
+        std::istream& is_;
+        unsigned long long keyframe_interval_ = 0;
+        std::vector<std::string> category_names_;
+        std::vector<std::size_t> num_choices_;
+
+        // Last frame read and the bytes left in its segment.
+        bool has_frame_ = false;
+        etsl_frame frame_;
+        unsigned long long segment_left_ = 0;
+
+    private:
+        [[noreturn]] static void invalid()
+        {
+            throw std::runtime_error("invalid delta stream");
+        }
+
+        unsigned long long read_varint(bool in_segment)
+        {
+            unsigned long long n = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                auto c = is_.rdbuf()->sbumpc();
+                if (c == std::char_traits<char>::eof()) {
+                    invalid();
+                }
+                if (in_segment) {
+                    if (segment_left_ == 0) {
+                        invalid();
+                    }
+                    --segment_left_;
+                }
+                n |= static_cast<unsigned long long>(c & 0x7f) << shift;
+                if (!(c & 0x80)) {
+                    return n;
+                }
+            }
+            invalid();
+        }
+
+        int read_choice(size_t cat)
+        {
+            auto n = read_varint(true);
+            if (n > num_choices_[cat]) {
+                invalid();
+            }
+            return static_cast<int>(n) - 1;
+        }
+
+        // Reads the head of the next segment up to frame_num. Returns false
+        // at the end of the stream.
+        bool read_segment_head()
+        {
+            if (is_.rdbuf()->sgetc() == std::char_traits<char>::eof()) {
+                return false;
+            }
+            if (read_varint(false) != category_names_.size()) {
+                invalid();
+            }
+            segment_left_ = read_varint(false);
+            frame_.number = read_varint(false);
+            has_frame_ = false;
+            return true;
+        }
+
+        void read_keyframe()
+        {
+            frame_.key.resize(category_names_.size());
+            for (size_t i = 0; i < category_names_.size(); ++i) {
+                frame_.key[i] = read_choice(i);
+            }
+            has_frame_ = true;
+        }
+
+    public:
+        // Reads the header.
+        explicit etsl_delta_reader(std::istream& is) : is_(is)
+        {
+            std::string magic = details::delta_stream_magic();
+            std::string s(magic.size(), '\0');
+            if (!is_.read(&s[0], s.size()) || s != magic) {
+                invalid();
+            }
+
+            keyframe_interval_ = read_varint(false);
+            auto n = read_varint(false);
+            if (keyframe_interval_ == 0 || n > (1 << 20)) {
+                invalid();
+            }
+            for (size_t i = 0; i < n; ++i) {
+                auto len = read_varint(false);
+                if (len > (1 << 20)) {
+                    invalid();
+                }
+                std::string name(len, '\0');
+                if (len != 0 && !is_.read(&name[0], len)) {
+                    invalid();
+                }
+                category_names_.push_back(std::move(name));
+                num_choices_.push_back(read_varint(false));
+            }
+        }
+
+        std::size_t num_categories() const
+        {
+            return category_names_.size();
+        }
+
+        const std::string& category_name(std::size_t cat) const
+        {
+            return category_names_.at(cat);
+        }
+
+        std::size_t num_choices(std::size_t cat) const
+        {
+            return num_choices_.at(cat);
+        }
+
+        // Reads the next frame. Returns false at the end of the stream.
+        bool next(etsl_frame& frame)
+        {
+            if (segment_left_ == 0) {
+                if (!read_segment_head()) {
+                    return false;
+                }
+                read_keyframe();
+            }
+            else {
+                auto first = read_varint(true);
+                if (first >= category_names_.size()) {
+                    invalid();
+                }
+                for (size_t i = first; i < category_names_.size(); ++i) {
+                    frame_.key[i] = read_choice(i);
+                }
+                ++frame_.number;
+            }
+
+            frame = frame_;
+            return true;
+        }
+
+        // Reads ahead to the frame with the Test Case number, skipping the
+        // segments before it without decoding them. Returns false if there
+        // is no such frame from the last one read on.
+        bool seek(unsigned long long frame_num, etsl_frame& frame)
+        {
+            if (has_frame_ && frame_.number == frame_num) {
+                frame = frame_;
+                return true;
+            }
+
+            // Skip the rest of the current segment if the frame is not in it.
+            if (segment_left_ != 0
+                && frame_num >= frame_.number + keyframe_interval_) {
+                if (!is_.ignore(segment_left_)) {
+                    invalid();
+                }
+                segment_left_ = 0;
+            }
+
+            while (segment_left_ == 0) {
+                if (!read_segment_head()) {
+                    return false;
+                }
+                if (frame_num < frame_.number + keyframe_interval_) {
+                    read_keyframe();
+                    break;
+                }
+                if (!is_.ignore(segment_left_)) {
+                    invalid();
+                }
+                segment_left_ = 0;
+            }
+
+            while (frame_.number < frame_num) {
+                if (!next(frame)) {
+                    return false;
+                }
+            }
+            frame = frame_;
+            return frame_.number == frame_num;
+        }
+    };
+}
+
+#endif
@@ -19,8 +19,10 @@
 
 #include <vector>
 #include <string>
+#include <algorithm>
 
 #include "etsl_predicate.hpp"
+#include "etsl_plan.hpp"
 
 namespace etsl {
     struct etsl_choice {
@@ -42,19 +44,99 @@ namespace etsl {
         }
     };
 
+    // Choices of a category declared as an integer range or a set of values
+    // instead of one by one. The choices are not materialized: choice i is
+    // the i-th value of the domain.
+    struct etsl_domain {
+        enum { kind_none, kind_range, kind_values } kind = kind_none;
+
+        // Bounds of a range, inclusive.
+        long long first = 0;
+        long long last = -1;
+
+        std::vector<std::string> values;
+
+        // Runs of choices [first, last) for which each comparison with the
+        // category in a predicate (e.g., size < 64) has the same result.
+        // props are the names of the comparisons that hold.
+        struct value_class {
+            int first;
+            int last;
+            std::vector<std::string> props;
+        };
+        std::vector<value_class> classes;
+
+        size_t size() const
+        {
+            return kind == kind_range ? last - first + 1 : values.size();
+        }
+
+        std::string name(int choice) const
+        {
+            return kind == kind_range ? std::to_string(first + choice)
+                                      : values[choice];
+        }
+
+        // Returns the index of the class of the choice.
+        size_t class_of(int choice) const
+        {
+            auto it = std::upper_bound(
+                    begin(classes), end(classes), choice,
+                    [](int c, const value_class& vc) { return c < vc.first; });
+            return it - begin(classes) - 1;
+        }
+    };
+
     struct etsl_category {
         std::string name;
         std::vector<etsl_choice> choices;
+        etsl_domain domain;
         bool mutually_exclusive;
 
+        // Properties that must all be set for any choice to be selectable,
+        // such as that of the choice importing the category. Otherwise the
+        // category is <n/a>.
+        std::vector<std::string> guard_props;
+
         etsl_category(std::string name, bool mutually_exclusive)
                 : name(std::move(name)), mutually_exclusive(mutually_exclusive)
         {
         }
+
+        bool has_domain() const
+        {
+            return domain.kind != etsl_domain::kind_none;
+        }
+
+        size_t num_choices() const
+        {
+            return has_domain() ? domain.size() : choices.size();
+        }
+
+        std::string choice_name(int choice) const
+        {
+            return has_domain() ? domain.name(choice) : choices[choice].name;
+        }
+    };
+
+    // Categories [first, last) of a file imported from the sub-spec at path,
+    // whose content had the hash.
+    struct etsl_import {
+        std::string path;
+        unsigned long long hash;
+        size_t first;
+        size_t last;
     };
 
     struct etsl_file {
         std::vector<etsl_category> categories;
+
+        // Imports in the order of their first categories, each followed by
+        // those nested in it.
+        std::vector<etsl_import> imports;
+
+        // Compiled from the categories by the parser.
+        details::etsl_plan plan;
     };
 }
 
@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2017, Yutaka Tsutano
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ETSL_FRAME_COUNTER_HPP
+#define ETSL_FRAME_COUNTER_HPP
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <cstdint>
+#include <stdexcept>
+#include <limits>
+#include <algorithm>
+
+#include "etsl_file.hpp"
+#include "etsl_choice_selector.hpp"
+#include "algorithm.hpp"
+
+namespace etsl {
+    namespace details {
+        // Counts the normal frames without enumerating them.
+        //
+        // The number of frames below a level only depends on the properties
+        // that the categories at and after the level refer to, so the counts
+        // are memoized per level on the set of such properties that are true.
+        class etsl_frame_counter {
+        public:
+            using count_type = unsigned long long;
+
+            // Number of frames below a level and the sum of the weights of
+            // the choices selected at and after the level over those frames.
+            struct subtree {
+                count_type count;
+                count_type weight;
+            };
+
+        private:
+            const etsl_file& file_;
+            const etsl_plan& plan_;
+
+            // Ids of the properties referred to at or after each level.
+            std::vector<std::vector<std::uint32_t>> needed_props_;
+
+            etsl_choice_selector selector_;
+
+            std::vector<std::unordered_map<std::string, subtree>> memo_;
+
+            // Sums of the weights of the choices by level: the sum of the
+            // weights of the choices before selected is at selected + 1.
+            std::vector<std::vector<count_type>> weight_sums_;
+
+            std::vector<std::vector<category_choice_state>> selections_;
+
+        private:
+            static count_type add(count_type a, count_type b)
+            {
+                if (a > std::numeric_limits<count_type>::max() - b) {
+                    throw std::runtime_error("too many frames to count");
+                }
+                return a + b;
+            }
+
+            static count_type mul(count_type a, count_type b)
+            {
+                if (b != 0 && a > std::numeric_limits<count_type>::max() / b) {
+                    throw std::runtime_error("too many frames to count");
+                }
+                return a * b;
+            }
+
+            // Returns the sum of the weights of count choices from selected.
+            count_type weight(size_t level, int selected, int count) const
+            {
+                if (weight_sums_.empty()) {
+                    return 0;
+                }
+                const auto& sums = weight_sums_[level];
+                return sums[selected + 1 + count] - sums[selected + 1];
+            }
+
+            // Collects the selectable choices at the level given the choices
+            // currently selected before it.
+            const std::vector<category_choice_state>&
+            selectable_choices(size_t level)
+            {
+                selector_.select_choices(level, selections_[level]);
+                return selections_[level];
+            }
+
+            subtree subtree_from(size_t level)
+            {
+                if (level >= file_.categories.size()) {
+                    return {1, 0};
+                }
+
+                std::string key;
+                key.reserve(needed_props_[level].size());
+                for (auto id : needed_props_[level]) {
+                    key.push_back(selector_.has_prop(id) ? '1' : '0');
+                }
+
+                auto it = memo_[level].find(key);
+                if (it != end(memo_[level])) {
+                    return it->second;
+                }
+
+                const auto& selection = selectable_choices(level);
+
+                // The choices in a run have the same subtree.
+                subtree result = {0, 0};
+                for (const auto& st : selection) {
+                    selector_.select(st);
+                    subtree child = subtree_from(level + 1);
+                    selector_.deselect(st);
+
+                    result.count = add(result.count, mul(child.count, st.count));
+                    result.weight = add(
+                            add(result.weight, mul(child.weight, st.count)),
+                            mul(weight(level, st.selected, st.count),
+                                child.count));
+                }
+
+                memo_[level].emplace(std::move(key), result);
+                return result;
+            }
+
+            count_type count_from(size_t level)
+            {
+                return subtree_from(level).count;
+            }
+
+        public:
+            explicit etsl_frame_counter(const etsl_file& file)
+                    : file_(file),
+                      plan_(file.plan),
+                      needed_props_(file.categories.size()),
+                      selector_(file.plan),
+                      memo_(file.categories.size()),
+                      selections_(file.categories.size())
+            {
+                // Collect the properties referred to at or after each level.
+                std::vector<std::uint32_t> needed;
+                for (size_t i = plan_.num_categories(); i-- > 0;) {
+                    if (plan_.category_flags[i]
+                        & etsl_plan::category_has_guard) {
+                        plan_.collect_props(plan_.category_guard[i], needed);
+                    }
+                    for (auto j = plan_.choice_begin[i];
+                         j < plan_.choice_begin[i + 1]; ++j) {
+                        if (plan_.choice_flags[j] & etsl_plan::choice_has_if) {
+                            plan_.collect_props(plan_.choice_cond[j], needed);
+                        }
+                    }
+                    unique_sort(needed);
+                    needed_props_[i] = needed;
+                }
+            }
+
+            // Weights the choices so that weight_before() can sum them. The
+            // weights are indexed by level and selected + 1.
+            void set_weights(const std::vector<std::vector<count_type>>& weights)
+            {
+                weight_sums_.clear();
+                for (const auto& w : weights) {
+                    weight_sums_.emplace_back(1, 0);
+                    for (count_type x : w) {
+                        weight_sums_.back().push_back(
+                                add(weight_sums_.back().back(), x));
+                    }
+                }
+                for (auto& m : memo_) {
+                    m.clear();
+                }
+            }
+
+            // Returns the number of normal frames.
+            count_type count()
+            {
+                return count_from(0);
+            }
+
+            // Returns the sum of the weights of the choices selected in the
+            // normal frames before the given position in the order of the
+            // keys (0 <= rank <= count()).
+            count_type weight_before(count_type rank)
+            {
+                subtree all = subtree_from(0);
+                if (rank >= all.count) {
+                    return all.weight;
+                }
+
+                std::vector<category_choice_state> state_stack;
+                count_type prefix_weight = 0;
+                count_type sum = 0;
+                for (size_t level = 0; level < file_.categories.size();
+                     ++level) {
+                    const auto& selection = selectable_choices(level);
+
+                    for (const auto& st : selection) {
+                        selector_.select(st);
+                        subtree child = subtree_from(level + 1);
+
+                        // Sum the frames below the choices in the run before
+                        // the one containing the rank.
+                        count_type n = std::min<count_type>(
+                                st.count, rank / child.count);
+                        sum = add(sum, mul(child.weight, n));
+                        sum = add(sum,
+                                  mul(add(mul(prefix_weight, n),
+                                          weight(level, st.selected, n)),
+                                      child.count));
+                        rank -= child.count * n;
+                        if (n < static_cast<count_type>(st.count)) {
+                            state_stack.push_back(st);
+                            state_stack.back().selected += n;
+                            state_stack.back().count = 1;
+                            prefix_weight = add(
+                                    prefix_weight,
+                                    weight(level, st.selected + n, 1));
+                            break;
+                        }
+                        selector_.deselect(st);
+                    }
+                }
+
+                for (size_t level = state_stack.size(); level-- > 0;) {
+                    selector_.deselect(state_stack[level]);
+                }
+
+                return sum;
+            }
+
+            // Returns the number of single and error frames.
+            count_type count_single() const
+            {
+                count_type count = 0;
+                for (const auto& cat : file_.categories) {
+                    for (const auto& ch : cat.choices) {
+                        count += !ch.single_str.empty();
+                        count += !ch.if_single_str.empty();
+                        count += !ch.else_single_str.empty();
+                    }
+                }
+                return count;
+            }
+
+            // Finds the normal frame at the given position in the order of
+            // the keys (0 <= rank < count()).
+            std::vector<category_choice_state> unrank(count_type rank)
+            {
+                std::vector<category_choice_state> state_stack;
+
+                for (size_t level = 0; level < file_.categories.size();
+                     ++level) {
+                    const auto& selection = selectable_choices(level);
+
+                    bool found = false;
+                    for (const auto& st : selection) {
+                        selector_.select(st);
+                        count_type n = count_from(level + 1);
+                        if (rank / n < static_cast<count_type>(st.count)) {
+                            state_stack.push_back(st);
+                            state_stack.back().selected += rank / n;
+                            state_stack.back().count = 1;
+                            rank %= n;
+                            found = true;
+                            break;
+                        }
+                        selector_.deselect(st);
+                        rank -= n * st.count;
+                    }
+
+                    if (!found) {
+                        throw std::out_of_range("frame rank out of range");
+                    }
+                }
+
+                for (size_t level = state_stack.size(); level-- > 0;) {
+                    selector_.deselect(state_stack[level]);
+                }
+
+                return state_stack;
+            }
+
+            // Finds the normal frame with the given key (-1 for <n/a>) and
+            // its position in the order of the keys. Returns false if there
+            // is no such frame.
+            bool find(const std::vector<int>& key,
+                      std::vector<category_choice_state>& state_stack,
+                      count_type& rank)
+            {
+                state_stack.clear();
+                rank = 0;
+
+                bool found = key.size() == file_.categories.size();
+                for (size_t level = 0; found && level < key.size(); ++level) {
+                    const auto& selection = selectable_choices(level);
+
+                    found = false;
+                    for (const auto& st : selection) {
+                        selector_.select(st);
+                        count_type n = count_from(level + 1);
+                        if (key[level] >= st.selected
+                            && key[level] < st.selected + st.count) {
+                            state_stack.push_back(st);
+                            state_stack.back().selected = key[level];
+                            state_stack.back().count = 1;
+                            rank += n * (key[level] - st.selected);
+                            found = true;
+                            break;
+                        }
+                        rank += n * st.count;
+                        selector_.deselect(st);
+                    }
+                }
+
+                for (size_t level = state_stack.size(); level-- > 0;) {
+                    selector_.deselect(state_stack[level]);
+                }
+
+                return found;
+            }
+        };
+    }
+
+    // Returns the number of frames (including single and error frames) that
+    // write_tsl_frames() would write.
+    inline unsigned long long count_tsl_frames(const etsl_file& file)
+    {
+        details::etsl_frame_counter counter(file);
+        return counter.count_single() + counter.count();
+    }
+}
+
+#endif
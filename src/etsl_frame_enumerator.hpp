@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2017, Yutaka Tsutano
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ETSL_FRAME_ENUMERATOR_HPP
+#define ETSL_FRAME_ENUMERATOR_HPP
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+
+#include "etsl.hpp"
+#include "etsl_file.hpp"
+#include "etsl_choice_selector.hpp"
+#include "algorithm.hpp"
+
+namespace etsl {
+    namespace details {
+        // Visits the normal frames depth-first in the given order.
+        //
+        // The choices selectable within the categories of an imported
+        // sub-spec only depend on the properties they refer to, so in
+        // lexicographic order they are recorded as a tree the first time the
+        // sub-spec is visited with each state of those properties, and
+        // replayed from the tree whenever it is visited with that state
+        // again.
+        class etsl_frame_enumerator {
+        private:
+            // Selectable choices of the categories of a sub-spec. Node n
+            // holds the states [first, last), and the node below state k
+            // at the next category is child[k].
+            struct block_tree {
+                struct node {
+                    std::uint32_t first;
+                    std::uint32_t last;
+                };
+                std::vector<node> nodes;
+                std::vector<category_choice_state> states;
+                std::vector<std::uint32_t> child;
+            };
+
+            // Categories [first, last) of an outermost import, the ids of
+            // the properties they refer to, and their trees by the states of
+            // those properties.
+            struct block {
+                size_t first;
+                size_t last;
+                std::vector<std::uint32_t> needed_props;
+                std::unordered_map<std::string, block_tree> trees;
+                size_t num_states = 0;
+                bool full = false;
+            };
+
+            // Bound on the states recorded for a block.
+            static constexpr size_t max_block_states = 1 << 20;
+
+            const etsl_file& file_;
+            frame_order order_;
+
+            // Key of the last frame visited before if resuming.
+            const std::vector<int>* resume_key_ = nullptr;
+
+            // Choices selectable at each level and whether they are visited
+            // in reverse order.
+            std::vector<std::vector<category_choice_state>> selections_;
+            std::vector<bool> reversed_;
+
+            etsl_choice_selector selector_;
+
+            std::vector<category_choice_state> state_stack_;
+            bool stopped_ = false;
+
+            std::vector<block> blocks_;
+            std::vector<int> block_at_;
+            std::string block_key_;
+
+        private:
+            // Records the choices selectable from the level on. Returns
+            // false if the tree grows too large.
+            bool build_block_tree(block_tree& t, size_t level, size_t last,
+                                  size_t max_states)
+            {
+                auto& selection = selections_[level];
+                selector_.select_choices(level, selection);
+
+                const std::uint32_t first = t.states.size();
+                t.states.insert(end(t.states), begin(selection),
+                                end(selection));
+                t.child.resize(t.states.size(), 0);
+                const std::uint32_t node_last = t.states.size();
+                t.nodes.push_back({first, node_last});
+                if (t.states.size() > max_states) {
+                    return false;
+                }
+                if (level + 1 == last) {
+                    return true;
+                }
+
+                for (auto k = first; k < node_last; ++k) {
+                    auto st = t.states[k];
+                    t.child[k] = t.nodes.size();
+                    selector_.select(st);
+                    bool ok = build_block_tree(t, level + 1, last, max_states);
+                    selector_.deselect(st);
+                    if (!ok) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+            // Returns the tree of the block given the choices selected
+            // before it, or nullptr if there are too many to record.
+            const block_tree* find_block_tree(block& b)
+            {
+                block_key_.clear();
+                for (auto id : b.needed_props) {
+                    block_key_.push_back(selector_.has_prop(id) ? '1' : '0');
+                }
+
+                auto it = b.trees.find(block_key_);
+                if (it != end(b.trees)) {
+                    return &it->second;
+                }
+                if (b.full) {
+                    return nullptr;
+                }
+
+                block_tree t;
+                if (!build_block_tree(t, b.first, b.last,
+                                      max_block_states - b.num_states)) {
+                    b.full = true;
+                    return nullptr;
+                }
+                b.num_states += t.states.size();
+                return &b.trees.emplace(block_key_, std::move(t)).first->second;
+            }
+
+            template <typename F>
+            void visit_block(const block_tree& t, std::uint32_t n,
+                             size_t last, const F& on_frame)
+            {
+                const size_t level = state_stack_.size();
+                state_stack_.emplace_back();
+
+                for (auto k = t.nodes[n].first; k < t.nodes[n].last; ++k) {
+                    const auto& run = t.states[k];
+                    for (int j = 0; j < run.count && !stopped_; ++j) {
+                        state_stack_.back() = run;
+                        state_stack_.back().selected += j;
+                        state_stack_.back().count = 1;
+                        selector_.select(run);
+                        if (level + 1 == last) {
+                            visit_category(on_frame);
+                        }
+                        else {
+                            visit_block(t, t.child[k], last, on_frame);
+                        }
+                        selector_.deselect(run);
+                    }
+                }
+
+                state_stack_.pop_back();
+            }
+
+            template <typename F>
+            void visit_category(const F& on_frame)
+            {
+                size_t level = state_stack_.size();
+                if (level >= file_.categories.size()) {
+                    if (resume_key_ != nullptr) {
+                        // This is the last frame visited before.
+                        resume_key_ = nullptr;
+                        return;
+                    }
+                    on_frame(state_stack_);
+                    return;
+                }
+
+                if (block_at_[level] >= 0 && resume_key_ == nullptr
+                    && order_ == frame_order::lexicographic) {
+                    auto& b = blocks_[block_at_[level]];
+                    if (const block_tree* t = find_block_tree(b)) {
+                        visit_block(*t, 0, b.last, on_frame);
+                        return;
+                    }
+                }
+
+                auto& selection = selections_[level];
+                selector_.select_choices(level, selection);
+
+                state_stack_.emplace_back();
+
+                auto visit = [&](const category_choice_state& run, int i) {
+                    if (stopped_) {
+                        return;
+                    }
+                    if (resume_key_ != nullptr
+                        && run.selected + i != (*resume_key_)[level]) {
+                        return;
+                    }
+                    state_stack_.back() = run;
+                    state_stack_.back().selected += i;
+                    state_stack_.back().count = 1;
+                    selector_.select(run);
+                    visit_category(on_frame);
+                    selector_.deselect(run);
+                };
+                if (!reversed_[level]) {
+                    for (size_t i = 0; i < selection.size(); ++i) {
+                        for (int j = 0; j < selection[i].count; ++j) {
+                            visit(selection[i], j);
+                        }
+                    }
+                }
+                else {
+                    for (size_t i = selection.size(); i-- > 0;) {
+                        for (int j = selection[i].count; j-- > 0;) {
+                            visit(selection[i], j);
+                        }
+                    }
+                }
+
+                // Reflect the order of this category for the next visit so
+                // that adjacent frames differ in as few categories as
+                // possible.
+                if (order_ == frame_order::gray) {
+                    reversed_[level] = !reversed_[level];
+                }
+
+                state_stack_.pop_back();
+            }
+
+        public:
+            etsl_frame_enumerator(const etsl_file& file, frame_order order)
+                    : file_(file),
+                      order_(order),
+                      selections_(file.categories.size()),
+                      reversed_(file.categories.size(), false),
+                      selector_(file.plan),
+                      block_at_(file.categories.size(), -1)
+            {
+                // The nested imports follow the ones they are nested in.
+                const auto& plan = file.plan;
+                size_t covered = 0;
+                for (const auto& imp : file.imports) {
+                    if (imp.first < covered || imp.first == imp.last) {
+                        continue;
+                    }
+                    covered = imp.last;
+
+                    block b;
+                    b.first = imp.first;
+                    b.last = imp.last;
+                    for (size_t i = b.first; i < b.last; ++i) {
+                        if (plan.category_flags[i]
+                            & etsl_plan::category_has_guard) {
+                            plan.collect_props(plan.category_guard[i],
+                                               b.needed_props);
+                        }
+                        for (auto j = plan.choice_begin[i];
+                             j < plan.choice_begin[i + 1]; ++j) {
+                            if (plan.choice_flags[j]
+                                & etsl_plan::choice_has_if) {
+                                plan.collect_props(plan.choice_cond[j],
+                                                   b.needed_props);
+                            }
+                        }
+                    }
+                    unique_sort(b.needed_props);
+
+                    block_at_[b.first] = blocks_.size();
+                    blocks_.push_back(std::move(b));
+                }
+            }
+
+            // Starts after the frame at the position instead of the first
+            // frame.
+            void resume(const etsl_frame_position& pos)
+            {
+                if (pos.key.size() != file_.categories.size()
+                    || pos.reversed.size() != file_.categories.size()) {
+                    throw std::runtime_error(
+                            "cannot resume from a frame not in the input");
+                }
+                resume_key_ = &pos.key;
+                reversed_ = pos.reversed;
+            }
+
+            // Whether each category is being visited in reverse order.
+            const std::vector<bool>& reversed() const
+            {
+                return reversed_;
+            }
+
+            // Visits no more frames after the current one.
+            void stop()
+            {
+                stopped_ = true;
+            }
+
+            // Calls on_frame with the state of each category for each frame.
+            template <typename F>
+            void enumerate(const F& on_frame)
+            {
+                state_stack_.clear();
+                stopped_ = false;
+                visit_category(on_frame);
+
+                if (resume_key_ != nullptr) {
+                    throw std::runtime_error(
+                            "cannot resume from a frame not in the input");
+                }
+            }
+        };
+    }
+}
+
+#endif
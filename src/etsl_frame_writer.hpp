@@ -19,8 +19,15 @@
 
 #include <fstream>
 #include <iomanip>
+#include <random>
+#include <stdexcept>
+#include <unordered_set>
 
+#include "etsl.hpp"
 #include "etsl_file.hpp"
+#include "etsl_choice_selector.hpp"
+#include "etsl_frame_enumerator.hpp"
+#include "etsl_frame_counter.hpp"
 
 namespace etsl {
     namespace details {
@@ -28,13 +35,13 @@ namespace etsl {
         private:
             std::ostream& os_;
             const etsl_file& file_;
-            int frame_num_ = 0;
+            unsigned long long frame_num_ = 0;
             size_t cat_name_maxlen_;
 
-            struct category_choice_state {
-                int selected;
-                const std::vector<std::string>* props = nullptr;
-            };
+            const etsl_write_options& options_;
+            etsl_frame_enumerator enumerator_;
+            unsigned long long frames_since_progress_ = 0;
+            unsigned long long normal_frames_written_ = 0;
 
             void write_frame_heading()
             {
@@ -64,19 +71,8 @@ namespace etsl {
                     << "\n\n";
             }
 
-            void write_single_frames()
-            {
-                for (const auto& cat : file_.categories) {
-                    for (const auto& ch : cat.choices) {
-                        write_single_frame(cat, ch, ch.single_str, "");
-                        write_single_frame(cat, ch, ch.if_single_str, "if");
-                        write_single_frame(cat, ch, ch.else_single_str, "else");
-                    }
-                }
-            }
-
-            void
-            write_normal_frame(std::vector<category_choice_state>& state_stack)
+            void write_normal_frame(
+                    const std::vector<category_choice_state>& state_stack)
             {
                 int level = state_stack.size();
 
@@ -94,88 +90,60 @@ namespace etsl {
                     os_ << "   " << std::setw(cat_name_maxlen_);
                     os_ << cat.name;
                     os_ << " :  ";
-                    os_ << (sel == -1 ? "<n/a>" : cat.choices[sel].name);
+                    if (sel == -1) {
+                        os_ << "<n/a>";
+                    }
+                    else if (!cat.has_domain()) {
+                        os_ << cat.choices[sel].name;
+                    }
+                    else if (cat.domain.kind == etsl_domain::kind_range) {
+                        os_ << cat.domain.first + sel;
+                    }
+                    else {
+                        os_ << cat.domain.values[sel];
+                    }
                     os_ << "\n";
                 }
                 os_ << "\n";
             }
 
-            void visit_category(std::vector<category_choice_state>& state_stack)
+            void report_progress(
+                    const std::vector<category_choice_state>& state_stack)
             {
-                size_t level = state_stack.size();
-                if (level >= file_.categories.size()) {
-                    write_normal_frame(state_stack);
+                if (!options_.on_progress
+                    || ++frames_since_progress_ < options_.progress_interval) {
                     return;
                 }
+                frames_since_progress_ = 0;
 
-                state_stack.emplace_back();
-
-                bool selected = false;
-
-                const auto& cat = file_.categories[level];
-                for (size_t i = 0; i < cat.choices.size(); ++i) {
-                    const auto& ch = cat.choices[i];
-
-                    auto prop_map = [&](const std::string& s) {
-                        for (int j = level - 1; j >= 0; --j) {
-                            const auto* p = state_stack[j].props;
-                            if (p != nullptr
-                                && std::binary_search(begin(*p), end(*p), s)) {
-                                return true;
-                            }
-                        }
-                        return false;
-                    };
-                    if (!ch.has_if) {
-                        if (ch.single_str.empty()) {
-                            state_stack.back().selected = i;
-                            state_stack.back().props = &ch.if_props;
-                            visit_category(state_stack);
-                            selected = true;
-                        }
-                    }
-                    else if (ch.cond(prop_map)) {
-                        if (ch.single_str.empty() && ch.if_single_str.empty()) {
-                            state_stack.back().selected = i;
-                            state_stack.back().props = &ch.if_props;
-                            visit_category(state_stack);
-                            selected = true;
-                        }
-                    }
-                    else if (ch.has_else) {
-                        if (ch.single_str.empty()
-                            && ch.else_single_str.empty()) {
-                            state_stack.back().selected = i;
-                            state_stack.back().props = &ch.else_props;
-                            visit_category(state_stack);
-                            selected = true;
-                        }
-                    }
-
-                    if (selected && cat.mutually_exclusive) {
-                        break;
-                    }
-                }
-
-                // If none is selected for this category, we need to select N/A.
-                if (!selected) {
-                    state_stack.back().selected = -1;
-                    state_stack.back().props = nullptr;
-                    visit_category(state_stack);
+                etsl_frame_position pos;
+                pos.frame_num = frame_num_;
+                for (const auto& st : state_stack) {
+                    pos.key.push_back(st.selected);
                 }
-
-                state_stack.pop_back();
+                pos.reversed = enumerator_.reversed();
+                options_.on_progress(pos);
             }
 
             void write_normal_frames()
             {
-                std::vector<category_choice_state> state_stack;
-                visit_category(state_stack);
+                enumerator_.enumerate([&](const std::vector<
+                                          category_choice_state>& state_stack) {
+                    write_normal_frame(state_stack);
+                    report_progress(state_stack);
+                    if (++normal_frames_written_ == options_.max_frames) {
+                        enumerator_.stop();
+                    }
+                });
             }
 
         public:
-            etsl_frame_writer(std::ostream& os, const etsl_file& file)
-                    : os_(os), file_(file)
+            etsl_frame_writer(std::ostream& os, const etsl_file& file,
+                              const etsl_write_options& options)
+                    : os_(os),
+                      file_(file),
+                      options_(options),
+                      enumerator_(file, options.order)
             {
                 // Compute the maximum length of the category names.
                 cat_name_maxlen_ = 0;
@@ -186,18 +154,147 @@ namespace etsl {
                 }
             }
 
-            void write()
+            // Writes the single and error frames, which come before the
+            // normal frames.
+            void write_single_frames()
+            {
+                for (const auto& cat : file_.categories) {
+                    for (const auto& ch : cat.choices) {
+                        write_single_frame(cat, ch, ch.single_str, "");
+                        write_single_frame(cat, ch, ch.if_single_str, "if");
+                        write_single_frame(cat, ch, ch.else_single_str, "else");
+                    }
+                }
+            }
+
+            // Returns the number of frames written, including those skipped
+            // when resuming.
+            unsigned long long write()
             {
-                write_single_frames();
+                const auto* pos = options_.resume_from;
+                if (pos != nullptr) {
+                    enumerator_.resume(*pos);
+                    frame_num_ = pos->frame_num;
+                }
+                else {
+                    write_single_frames();
+                }
                 write_normal_frames();
+                return frame_num_;
+            }
+
+            void write(const std::vector<category_choice_state>& state_stack)
+            {
+                write_normal_frame(state_stack);
+            }
+
+            // Sets the number of frames written before the next frame.
+            void set_frame_num(unsigned long long frame_num)
+            {
+                frame_num_ = frame_num;
             }
         };
     }
 
-    void write_tsl_frames(std::ostream& os, const etsl_file& file)
+    inline unsigned long long
+    write_tsl_frames(std::ostream& os, const etsl_file& file,
+                     const etsl_write_options& options)
+    {
+        details::etsl_frame_writer writer(os, file, options);
+        return writer.write();
+    }
+
+    inline void write_tsl_frames(std::ostream& os, const etsl_file& file,
+                                 frame_order order = frame_order::lexicographic)
     {
-        details::etsl_frame_writer writer(os, file);
-        writer.write();
+        etsl_write_options options;
+        options.order = order;
+        write_tsl_frames(os, file, options);
+    }
+
+    // Writes the normal frame with the given key, numbered as in the output
+    // of write_tsl_frames(). Returns false if there is no such frame.
+    inline bool write_tsl_frame(std::ostream& os, const etsl_file& file,
+                         const std::vector<int>& key)
+    {
+        details::etsl_frame_counter counter(file);
+        std::vector<details::category_choice_state> state_stack;
+        details::etsl_frame_counter::count_type rank;
+        if (!counter.find(key, state_stack, rank)) {
+            return false;
+        }
+
+        etsl_write_options options;
+        details::etsl_frame_writer writer(os, file, options);
+        writer.set_frame_num(counter.count_single() + rank);
+        writer.write(state_stack);
+        return true;
+    }
+
+    // Writes n normal frames drawn uniformly at random from all the normal
+    // frames, in the order of their keys and numbered as in the output of
+    // write_tsl_frames(). The same seed draws the same frames. If unique is
+    // set, the frames are drawn without replacement.
+    inline void write_sampled_tsl_frames(std::ostream& os,
+                                         const etsl_file& file,
+                                         unsigned long long n,
+                                         unsigned long long seed, bool unique)
+    {
+        using count_type = details::etsl_frame_counter::count_type;
+
+        details::etsl_frame_counter counter(file);
+        count_type total = counter.count();
+        if (total == 0 || n == 0) {
+            return;
+        }
+
+        // The ranks are taken from the output of the engine by rejection
+        // rather than through std::uniform_int_distribution, whose algorithm
+        // differs between standard libraries, so that the same seed draws
+        // the same frames everywhere.
+        std::mt19937_64 engine(seed);
+        auto draw = [&](count_type max) {
+            count_type range = max + 1;
+            if (range == 0) {
+                return static_cast<count_type>(engine());
+            }
+            count_type threshold = (0 - range) % range;
+            count_type x;
+            do {
+                x = engine();
+            } while (x < threshold);
+            return x % range;
+        };
+
+        std::vector<count_type> ranks;
+        if (!unique) {
+            for (count_type i = 0; i < n; ++i) {
+                ranks.push_back(draw(total - 1));
+            }
+        }
+        else if (n >= total) {
+            for (count_type i = 0; i < total; ++i) {
+                ranks.push_back(i);
+            }
+        }
+        else {
+            // Floyd's algorithm.
+            std::unordered_set<count_type> drawn;
+            for (count_type j = total - n; j < total; ++j) {
+                count_type r = draw(j);
+                drawn.insert(drawn.count(r) == 0 ? r : j);
+            }
+            ranks.assign(begin(drawn), end(drawn));
+        }
+        std::sort(begin(ranks), end(ranks));
+
+        etsl_write_options options;
+        details::etsl_frame_writer writer(os, file, options);
+        const auto first_num = counter.count_single();
+        for (count_type r : ranks) {
+            writer.set_frame_num(first_num + r);
+            writer.write(counter.unrank(r));
+        }
     }
 }
 
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2017, Yutaka Tsutano
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ETSL_IMPORT_HPP
+#define ETSL_IMPORT_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+
+#include "etsl_file.hpp"
+#include "etsl_tokenizer.hpp"
+#include "etsl_parser.hpp"
+#include "algorithm.hpp"
+
+namespace etsl {
+    // Sub-specs loaded for the imports of a spec by their resolved paths, so
+    // that a sub-spec imported more than once is only loaded once.
+    class etsl_import_cache {
+    private:
+        std::mutex mutex_;
+        std::unordered_map<std::string, etsl_loaded_import> files_;
+
+    public:
+        // Returns the loader of the imports of a spec, whose paths are
+        // relative to dir (the current directory if empty). chain holds the
+        // sub-specs importing the spec, which it must not import again.
+        etsl_import_loader loader(const std::string& dir,
+                                  std::vector<std::string> chain = {})
+        {
+            return [this, dir, chain](const std::string& path) {
+                std::string full = dir.empty() || path.empty() || path[0] == '/'
+                        ? path
+                        : dir + "/" + path;
+                char resolved[PATH_MAX];
+                if (realpath(full.c_str(), resolved) == nullptr) {
+                    throw std::runtime_error("cannot open " + path);
+                }
+
+                etsl_loaded_import sub;
+                sub.path = resolved;
+                if (std::find(begin(chain), end(chain), sub.path)
+                    != end(chain)) {
+                    throw std::runtime_error("circular import of " + path);
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    auto it = files_.find(sub.path);
+                    if (it != end(files_)) {
+                        return it->second;
+                    }
+                }
+
+                std::ifstream ifs(sub.path);
+                if (!ifs) {
+                    throw std::runtime_error("cannot open " + path);
+                }
+                std::ostringstream oss;
+                oss << ifs.rdbuf();
+                std::string input = oss.str();
+                sub.hash = fnv1a_hash(input);
+
+                auto sub_chain = chain;
+                sub_chain.push_back(sub.path);
+                sub.file = std::make_shared<const etsl_file>(etsl_parse(
+                        etsl_tokenize(input.data(), input.size()),
+                        loader(parent_directory(sub.path), sub_chain)));
+
+                std::lock_guard<std::mutex> lock(mutex_);
+                files_.emplace(sub.path, sub);
+                return sub;
+            };
+        }
+    };
+}
+
+#endif
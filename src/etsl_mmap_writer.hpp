@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) 2017, Yutaka Tsutano
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ETSL_MMAP_WRITER_HPP
+#define ETSL_MMAP_WRITER_HPP
+
+#include <sstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "etsl.hpp"
+#include "etsl_file.hpp"
+#include "etsl_frame_counter.hpp"
+#include "etsl_frame_writer.hpp"
+#include "etsl_thread_pool.hpp"
+
+namespace etsl {
+    namespace details {
+        // Stream buffer writing to a fixed range of memory.
+        class span_streambuf : public std::streambuf {
+        public:
+            span_streambuf(char* first, char* last)
+            {
+                setp(first, last);
+            }
+
+            size_t size() const
+            {
+                return pptr() - pbase();
+            }
+        };
+
+        inline unsigned long long num_digits(unsigned long long n)
+        {
+            unsigned long long digits = 1;
+            for (; n >= 10; n /= 10) {
+                ++digits;
+            }
+            return digits;
+        }
+
+        // Returns the sum of the widths of the Test Case numbers 1 to n, which
+        // are padded to 3 characters.
+        inline unsigned long long frame_num_width_sum(unsigned long long n)
+        {
+            unsigned long long sum = 0;
+            unsigned long long first = 1;
+            for (unsigned long long digits = 1; first <= n; ++digits) {
+                unsigned long long last = first * 10 - 1;
+                if (last > n || first * 10 / 10 != first) {
+                    last = n;
+                }
+                sum += (last - first + 1) * std::max(digits, 3ull);
+                first = last + 1;
+            }
+            return sum;
+        }
+
+        // Sizes of the output of write_tsl_frames() up to each normal frame,
+        // computed from the frame counts without writing the frames.
+        class etsl_output_layout {
+        private:
+            using count_type = etsl_frame_counter::count_type;
+
+            etsl_frame_counter counter_;
+            count_type singles_size_;
+            count_type fixed_size_;
+            count_type num_singles_;
+            count_type num_normals_;
+
+        public:
+            explicit etsl_output_layout(const etsl_file& file)
+                    : counter_(file)
+            {
+                etsl_write_options options;
+
+                std::ostringstream singles;
+                etsl_frame_writer singles_writer(singles, file, options);
+                singles_writer.write_single_frames();
+                singles_size_ = singles.str().size();
+
+                // Weigh each choice by the size of its part in the key and
+                // its line so that the counter can sum the size of the
+                // frames.
+                size_t cat_name_maxlen = 0;
+                for (const auto& cat : file.categories) {
+                    cat_name_maxlen = std::max(cat_name_maxlen,
+                                               cat.name.size());
+                }
+                std::vector<std::vector<count_type>> weights;
+                for (const auto& cat : file.categories) {
+                    weights.emplace_back();
+                    weights.back().push_back(2 + std::string("<n/a>").size());
+                    for (size_t i = 0; i < cat.num_choices(); ++i) {
+                        weights.back().push_back(num_digits(i + 1) + 1
+                                                 + cat.choice_name(i).size());
+                    }
+                }
+                fixed_size_
+                        = std::string("\nTest Case \t\t(Key = )\n\n").size()
+                        + file.categories.size() * (cat_name_maxlen + 8);
+
+                counter_.set_weights(weights);
+                num_singles_ = counter_.count_single();
+                num_normals_ = counter_.count();
+            }
+
+            count_type num_singles() const
+            {
+                return num_singles_;
+            }
+
+            count_type num_normals() const
+            {
+                return num_normals_;
+            }
+
+            // Returns the size of the output before the normal frame.
+            count_type offset(count_type rank)
+            {
+                return singles_size_ + fixed_size_ * rank
+                        + frame_num_width_sum(num_singles_ + rank)
+                        - frame_num_width_sum(num_singles_)
+                        + counter_.weight_before(rank);
+            }
+
+            // Returns the size of the whole output, which is the same in any
+            // order since the frames and their numbers are.
+            count_type total_size()
+            {
+                return offset(num_normals_);
+            }
+
+            etsl_frame_counter& counter()
+            {
+                return counter_;
+            }
+        };
+    }
+
+    // Returns the size of the output of write_tsl_frames() in any order.
+    inline unsigned long long tsl_frames_size(const etsl_file& file)
+    {
+        details::etsl_output_layout layout(file);
+        return layout.total_size();
+    }
+
+    // Writes the same output as write_tsl_frames() in the order of the keys,
+    // but on num_threads threads (0 for all the hardware supports). The size
+    // of the output of each range of frames is computed beforehand from the
+    // frame counts so that each thread writes its range directly into its
+    // part of the memory-mapped output file. Returns the number of frames.
+    inline unsigned long long write_tsl_frames_mmap(const std::string& filename,
+                                                    const etsl_file& file,
+                                                    size_t num_threads)
+    {
+        using count_type = details::etsl_frame_counter::count_type;
+
+        details::etsl_output_layout layout(file);
+        auto& counter = layout.counter();
+        const count_type num_singles = layout.num_singles();
+        const count_type num_normals = layout.num_normals();
+        const count_type total_size = layout.total_size();
+
+        int fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
+            throw std::runtime_error("cannot open " + filename);
+        }
+        char* data = nullptr;
+        if (total_size != 0) {
+#ifdef __linux__
+            bool allocated = posix_fallocate(fd, 0, total_size) == 0;
+#else
+            bool allocated = ftruncate(fd, total_size) == 0;
+#endif
+            void* p = allocated ? mmap(nullptr, total_size,
+                                       PROT_READ | PROT_WRITE, MAP_SHARED,
+                                       fd, 0)
+                                : MAP_FAILED;
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("cannot write " + filename);
+            }
+            data = static_cast<char*>(p);
+        }
+
+        // Split the frames into more ranges than threads to balance the load.
+        std::atomic<bool> failed(false);
+        {
+            etsl_thread_pool pool(num_threads);
+            count_type num_ranges = std::min<count_type>(
+                    std::max<count_type>(num_normals, 1), pool.size() * 4);
+
+            for (count_type i = 0; i < num_ranges; ++i) {
+                count_type first = num_normals * i / num_ranges;
+                count_type last = num_normals * (i + 1) / num_ranges;
+                count_type begin_offset = i == 0 ? 0 : layout.offset(first);
+                count_type end_offset = layout.offset(last);
+
+                // Each range resumes after the last frame of the previous
+                // one, and the first range writes the single frames too.
+                auto pos = std::make_shared<etsl_frame_position>();
+                if (i != 0) {
+                    pos->frame_num = num_singles + first;
+                    for (const auto& st : counter.unrank(first - 1)) {
+                        pos->key.push_back(st.selected);
+                    }
+                    pos->reversed.assign(file.categories.size(), false);
+                }
+
+                pool.submit([&, i, first, last, begin_offset, end_offset, pos] {
+                    try {
+                        details::span_streambuf buf(data + begin_offset,
+                                                    data + end_offset);
+                        std::ostream os(&buf);
+
+                        etsl_write_options range_options;
+                        range_options.resume_from = i != 0 ? pos.get()
+                                                           : nullptr;
+                        range_options.max_frames = last - first;
+                        details::etsl_frame_writer writer(os, file,
+                                                          range_options);
+                        if (last != first || i == 0) {
+                            writer.write();
+                        }
+
+                        if (!os || buf.size() != end_offset - begin_offset) {
+                            failed = true;
+                        }
+                    }
+                    catch (...) {
+                        failed = true;
+                    }
+                });
+            }
+            pool.wait();
+        }
+
+        if (data != nullptr) {
+            munmap(data, total_size);
+        }
+        ::close(fd);
+
+        if (failed) {
+            throw std::runtime_error("cannot write " + filename);
+        }
+
+        return num_singles + num_normals;
+    }
+}
+
+#endif
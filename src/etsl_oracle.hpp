@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2017, Yutaka Tsutano
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ETSL_ORACLE_HPP
+#define ETSL_ORACLE_HPP
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <thread>
+
+#include "etsl_file.hpp"
+#include "etsl_choice_selector.hpp"
+#include "etsl_thread_pool.hpp"
+
+namespace etsl {
+    namespace details {
+        // Selects the choices of the mutually exclusive categories given the
+        // choices of the others the same way the frames are enumerated.
+        class etsl_expectation_oracle {
+        private:
+            const etsl_file& file_;
+            const etsl_plan& plan_;
+            etsl_choice_selector selector_;
+
+            // Choices selected for the last key, which are kept up to the
+            // first category the next key differs in.
+            std::vector<category_choice_state> state_stack_;
+            std::vector<int> last_key_;
+
+            std::vector<category_choice_state> selection_;
+
+        private:
+            bool is_expectation(size_t level) const
+            {
+                return plan_.category_flags[level]
+                        & etsl_plan::category_mutually_exclusive;
+            }
+
+        public:
+            explicit etsl_expectation_oracle(const etsl_file& file)
+                    : file_(file),
+                      plan_(file.plan),
+                      selector_(file.plan),
+                      last_key_(file.categories.size())
+            {
+            }
+
+            ~etsl_expectation_oracle()
+            {
+                while (!state_stack_.empty()) {
+                    selector_.deselect(state_stack_.back());
+                    state_stack_.pop_back();
+                }
+            }
+
+            // Throws std::out_of_range if a choice of the categories that are
+            // not mutually exclusive is out of range.
+            void check(const int* key) const
+            {
+                for (size_t i = 0; i < file_.categories.size(); ++i) {
+                    if (!is_expectation(i)
+                        && (key[i] < -1
+                            || key[i] >= static_cast<int>(
+                                       file_.categories[i].num_choices()))) {
+                        throw std::out_of_range("choice out of range");
+                    }
+                }
+            }
+
+            // Fills in the choices of the mutually exclusive categories of
+            // the key. Throws std::out_of_range if another choice is out of
+            // range.
+            void evaluate(int* key)
+            {
+                const size_t num_categories = file_.categories.size();
+                check(key);
+
+                size_t level = 0;
+                while (level < state_stack_.size()
+                       && (is_expectation(level)
+                           || key[level] == last_key_[level])) {
+                    ++level;
+                }
+                while (state_stack_.size() > level) {
+                    selector_.deselect(state_stack_.back());
+                    state_stack_.pop_back();
+                }
+
+                for (; level < num_categories; ++level) {
+                    category_choice_state st;
+                    if (is_expectation(level)) {
+                        // The first selectable choice wins.
+                        selector_.select_choices(level, selection_);
+                        st = selection_.front();
+                    }
+                    else {
+                        st = selector_.choice_state(level, key[level]);
+                    }
+                    selector_.select(st);
+                    state_stack_.push_back(st);
+                }
+
+                for (level = 0; level < num_categories; ++level) {
+                    if (is_expectation(level)) {
+                        key[level] = state_stack_[level].selected;
+                    }
+                    last_key_[level] = key[level];
+                }
+            }
+
+        };
+
+        inline void write_key_number(std::string& out, int choice)
+        {
+            char buf[16];
+            char* p = buf + sizeof(buf);
+            unsigned n = choice + 1;
+            do {
+                *--p = '0' + n % 10;
+                n /= 10;
+            } while (n != 0);
+            out.append(p, buf + sizeof(buf));
+            out.push_back('.');
+        }
+    }
+
+    // Fills in the choices of the mutually exclusive categories of num_keys
+    // keys stored one after another on num_threads threads (0 for all the
+    // hardware supports). Throws std::out_of_range if another choice is out
+    // of range.
+    inline void evaluate_expectations(const etsl_file& file, int* keys,
+                                      size_t num_keys, size_t num_threads = 0)
+    {
+        const size_t num_categories = file.categories.size();
+        details::etsl_expectation_oracle oracle(file);
+
+        // Small batches are not worth the threads.
+        if (num_threads == 0) {
+            num_threads = std::thread::hardware_concurrency();
+        }
+        if (num_keys < (1 << 16) || num_threads <= 1) {
+            for (size_t k = 0; k < num_keys; ++k) {
+                oracle.evaluate(keys + k * num_categories);
+            }
+            return;
+        }
+
+        // Check the keys first since the tasks must not throw.
+        for (size_t k = 0; k < num_keys; ++k) {
+            oracle.check(keys + k * num_categories);
+        }
+
+        // Each thread evaluates a contiguous part so that consecutive keys
+        // still share the choices selected for their common prefixes.
+        etsl_thread_pool pool(num_threads);
+        const size_t num_parts = pool.size();
+        for (size_t i = 0; i < num_parts; ++i) {
+            pool.submit([&, i] {
+                details::etsl_expectation_oracle part_oracle(file);
+                for (size_t k = num_keys * i / num_parts;
+                     k < num_keys * (i + 1) / num_parts; ++k) {
+                    part_oracle.evaluate(keys + k * num_categories);
+                }
+            });
+        }
+        pool.wait();
+    }
+
+    // Reads the keys of the categories that are not mutually exclusive
+    // (e.g., "1.3.0.") one per line and writes the keys of the mutually
+    // exclusive ones, which the frames with the given choices would select,
+    // one per line. Throws std::runtime_error on an invalid line.
+    inline void answer_expectation_queries(std::istream& is, std::ostream& os,
+                                           const etsl_file& file)
+    {
+        const size_t num_categories = file.categories.size();
+        std::vector<size_t> params;
+        std::vector<size_t> expectations;
+        for (size_t i = 0; i < num_categories; ++i) {
+            (file.categories[i].mutually_exclusive ? expectations : params)
+                    .push_back(i);
+        }
+
+        std::vector<int> keys;
+        size_t num_keys = 0;
+        std::string out;
+        std::string line;
+        unsigned long long line_num = 0;
+
+        // Parses the line into the next key. Returns false if it is invalid.
+        auto parse_query = [&] {
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+
+            keys.resize((num_keys + 1) * num_categories, -1);
+            int* key = keys.data() + num_keys * num_categories;
+            size_t i = 0;
+            long long n = 0;
+            bool has_digit = false;
+            for (char c : line) {
+                if (c >= '0' && c <= '9' && n <= 1 << 30) {
+                    n = n * 10 + (c - '0');
+                    has_digit = true;
+                }
+                else if (c == '.' && has_digit && i < params.size()
+                         && n <= static_cast<long long>(
+                                    file.categories[params[i]].num_choices())) {
+                    key[params[i++]] = n - 1;
+                    n = 0;
+                    has_digit = false;
+                }
+                else {
+                    return false;
+                }
+            }
+            if (has_digit || i != params.size()) {
+                return false;
+            }
+            ++num_keys;
+            return true;
+        };
+
+        // Answers the queries parsed so far.
+        auto answer = [&] {
+            evaluate_expectations(file, keys.data(), num_keys, 1);
+            for (size_t k = 0; k < num_keys; ++k) {
+                for (auto cat : expectations) {
+                    details::write_key_number(
+                            out, keys[k * num_categories + cat]);
+                }
+                out.push_back('\n');
+            }
+            num_keys = 0;
+
+            os.write(out.data(), out.size());
+            os.flush();
+            out.clear();
+        };
+
+        // The queries are answered in batches, and whenever no more are
+        // available right away so that they can be interleaved with the
+        // answers through pipes.
+        while (std::getline(is, line)) {
+            ++line_num;
+            if (!parse_query()) {
+                answer();
+                throw std::runtime_error("invalid query on line "
+                                         + std::to_string(line_num));
+            }
+            if (num_keys >= 4096 || is.rdbuf()->in_avail() <= 0) {
+                answer();
+            }
+        }
+        answer();
+    }
+}
+
+#endif
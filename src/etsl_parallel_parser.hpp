@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2017, Yutaka Tsutano
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ETSL_PARALLEL_PARSER_HPP
+#define ETSL_PARALLEL_PARSER_HPP
+
+#include <vector>
+#include <string>
+#include <exception>
+#include <algorithm>
+
+#include "etsl.hpp"
+#include "etsl_file.hpp"
+#include "etsl_tokenizer.hpp"
+#include "etsl_parser.hpp"
+#include "etsl_thread_pool.hpp"
+#include "algorithm.hpp"
+
+namespace etsl {
+    namespace details {
+        enum class bracket_state { unknown, outside, inside };
+
+        // Returns whether [first, last), which starts at the beginning of a
+        // line, ends inside an attribute given the state at first. Sets
+        // last_bracket to the position of the last bracket if any.
+        inline bracket_state scan_brackets(const char* first, const char* last,
+                                           bracket_state state,
+                                           const char** last_bracket = nullptr)
+        {
+            for (const char* p = first; p != last; ++p) {
+                switch (*p) {
+                case '#':
+                    p = std::find(p, last, '\n');
+                    if (p == last) {
+                        return state;
+                    }
+                    break;
+                case '[':
+                case ']':
+                    state = *p == '[' ? bracket_state::inside
+                                      : bracket_state::outside;
+                    if (last_bracket != nullptr) {
+                        *last_bracket = p;
+                    }
+                    break;
+                }
+            }
+            return state;
+        }
+
+        // Splits the input into about num_chunks chunks, each starting at
+        // the beginning of a line outside any attribute so that it can be
+        // tokenized on its own. Returns the offsets of the chunks followed
+        // by the size of the input.
+        inline std::vector<size_t> split_input(const char* data, size_t size,
+                                               size_t num_chunks,
+                                               etsl_thread_pool& pool)
+        {
+            std::vector<size_t> offsets = {0};
+            for (size_t i = 1; i < num_chunks; ++i) {
+                const char* p = std::find(data + std::max(size * i / num_chunks,
+                                                          offsets.back()),
+                                          data + size, '\n');
+                if (p != data + size) {
+                    offsets.push_back(p + 1 - data);
+                }
+            }
+            offsets.push_back(size);
+            offsets.erase(std::unique(begin(offsets), end(offsets)),
+                          end(offsets));
+
+            // Find the last bracket in each chunk in parallel. The state at
+            // the end of a chunk only depends on it.
+            std::vector<bracket_state> end_states(offsets.size() - 1);
+            std::vector<const char*> last_brackets(offsets.size() - 1, nullptr);
+            for (size_t i = 0; i + 1 < offsets.size(); ++i) {
+                pool.submit([&, i] {
+                    end_states[i] = scan_brackets(
+                            data + offsets[i], data + offsets[i + 1],
+                            bracket_state::unknown, &last_brackets[i]);
+                });
+            }
+            pool.wait();
+
+            // Move the chunk boundaries inside an attribute to the first
+            // line boundary outside of it.
+            std::vector<size_t> safe_offsets = {0};
+            size_t known_offset = 0;
+            bracket_state known_state = bracket_state::outside;
+            for (size_t i = 1; i + 1 < offsets.size(); ++i) {
+                size_t offset = offsets[i];
+                if (offset <= known_offset) {
+                    continue;
+                }
+
+                bracket_state state = known_state;
+                if (last_brackets[i - 1] != nullptr
+                    && last_brackets[i - 1] >= data + known_offset) {
+                    state = end_states[i - 1];
+                }
+
+                while (state == bracket_state::inside && offset < size) {
+                    const char* p = data + offset;
+                    const char* eol = std::find(p, data + size, '\n');
+                    eol = eol != data + size ? eol + 1 : eol;
+                    state = scan_brackets(p, eol, state);
+                    offset = eol - data;
+                }
+                if (offset < size) {
+                    safe_offsets.push_back(offset);
+                }
+                known_offset = offset;
+                known_state = state;
+            }
+            safe_offsets.push_back(size);
+            return safe_offsets;
+        }
+    }
+
+    // Tokenizes and parses the input on num_threads threads (0 for all the
+    // hardware supports). The input is split at line boundaries outside the
+    // attributes and each chunk is tokenized on its own. The tokens are then
+    // split at category names and each chunk parsed on its own. The result,
+    // including the syntax error thrown if any, is the same as that of
+    // etsl_parse(etsl_tokenize(...), loader). The loader may be called from
+    // any of the threads.
+    inline etsl_file etsl_parse_parallel(const char* data, size_t size,
+                                         size_t num_threads = 0,
+                                         etsl_import_loader loader = nullptr)
+    {
+        etsl_thread_pool pool(num_threads);
+        const size_t num_chunks = pool.size() * 4;
+
+        // Tokenize.
+        auto offsets = details::split_input(data, size, num_chunks, pool);
+        size_t num_text_chunks = offsets.size() - 1;
+        std::vector<std::vector<etsl_token>> chunk_tokens(num_text_chunks);
+        std::vector<int> chunk_lines(num_text_chunks);
+        for (size_t i = 0; i < num_text_chunks; ++i) {
+            pool.submit([&, i] {
+                chunk_tokens[i].emplace_back();
+                chunk_lines[i] = details::tokenize_chunk(
+                        data + offsets[i], data + offsets[i + 1], 1,
+                        chunk_tokens[i]);
+            });
+        }
+        pool.wait();
+
+        // Merge the tokens. The unfinished token at the end of a chunk is
+        // continued by the next chunk.
+        std::vector<etsl_token> tokens;
+        std::string carry;
+        int line_offset = 0;
+        for (size_t i = 0; i < num_text_chunks; ++i) {
+            auto& ts = chunk_tokens[i];
+            ts.front().str.insert(0, carry);
+            carry = std::move(ts.back().str);
+            ts.pop_back();
+
+            for (auto& t : ts) {
+                t.line_num += line_offset;
+                trim_inplace(t.str);
+                tokens.push_back(std::move(t));
+            }
+            line_offset += chunk_lines[i] - 1;
+
+            ts.clear();
+            ts.shrink_to_fit();
+        }
+
+        // Split the tokens at category names.
+        std::vector<size_t> bounds = {0};
+        for (size_t i = 1; i < num_chunks; ++i) {
+            size_t b = std::max(tokens.size() * i / num_chunks, bounds.back());
+            while (b < tokens.size()
+                   && tokens[b].kind != etsl_token::kind_category) {
+                ++b;
+            }
+            if (b > bounds.back() && b < tokens.size()) {
+                bounds.push_back(b);
+            }
+        }
+        bounds.push_back(tokens.size());
+
+        // Parse the chunks.
+        struct chunk_result {
+            etsl_file file;
+            std::vector<detail::etsl_deferred_check> checks;
+            bool mutually_exclusive_choices = false;
+            std::exception_ptr error;
+            const etsl_token* error_token = nullptr;
+        };
+        std::vector<chunk_result> results(bounds.size() - 1);
+        for (size_t i = 0; i + 1 < bounds.size(); ++i) {
+            pool.submit([&, i] {
+                auto& r = results[i];
+                detail::etsl_parser parser(r.file, &r.checks, loader);
+                try {
+                    parser.parse(tokens.data() + bounds[i],
+                                 tokens.data() + bounds[i + 1]);
+                    parser.add_automatic_props();
+                }
+                catch (...) {
+                    r.error = std::current_exception();
+                    r.error_token = parser.error_token();
+                }
+                r.mutually_exclusive_choices
+                        = parser.mutually_exclusive_choices();
+            });
+        }
+        pool.wait();
+
+        // Merge the categories in order, completing what each chunk could
+        // not see: the section each chunk starts in and the categories
+        // before it.
+        etsl_file file;
+        detail::etsl_parser parser(file);
+        bool mutually_exclusive = false;
+        for (size_t i = 0; i < results.size(); ++i) {
+            auto& r = results[i];
+
+            // An empty category followed by another one is dropped, and
+            // the Expectations section starts after the one named so.
+            auto& cats = file.categories;
+            if (i > 0 && !cats.empty() && cats.back().choices.empty()
+                && !cats.back().has_domain()) {
+                if (cats.back().name == "Expectations") {
+                    mutually_exclusive = true;
+                }
+                cats.pop_back();
+            }
+
+            size_t category_offset = cats.size();
+            for (auto& cat : r.file.categories) {
+                cat.mutually_exclusive |= mutually_exclusive;
+                cats.push_back(std::move(cat));
+            }
+            for (auto& imp : r.file.imports) {
+                imp.first += category_offset;
+                imp.last += category_offset;
+                file.imports.push_back(std::move(imp));
+            }
+            mutually_exclusive |= r.mutually_exclusive_choices;
+
+            // The checks come before the syntax error of the chunk.
+            for (const auto& c : r.checks) {
+                if (r.error_token != nullptr && c.token > r.error_token) {
+                    break;
+                }
+                parser.check(c, category_offset);
+            }
+            if (r.error) {
+                std::rethrow_exception(r.error);
+            }
+        }
+
+        parser.finish();
+        return file;
+    }
+}
+
+#endif
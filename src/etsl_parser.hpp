@@ -18,18 +18,66 @@
 #define ETSL_PARSER_HPP
 
 #include <algorithm>
+#include <limits>
+#include <memory>
+#include <functional>
 
 #include "etsl_file.hpp"
 #include "etsl_tokenizer.hpp"
+#include "etsl_plan_compiler.hpp"
 #include "algorithm.hpp"
 
 namespace etsl {
+    // Sub-spec loaded for an import attribute, its resolved path, and the
+    // hash of the content it was parsed from.
+    struct etsl_loaded_import {
+        std::string path;
+        unsigned long long hash;
+        std::shared_ptr<const etsl_file> file;
+    };
+
+    // Loads the sub-spec at the path of an import attribute. Throws
+    // etsl_syntax_error on a syntax error in it, or std::runtime_error if it
+    // cannot be loaded.
+    using etsl_import_loader
+            = std::function<etsl_loaded_import(const std::string& path)>;
+
     namespace detail {
+        // Check of an attribute that depends on the categories before the
+        // chunk of tokens being parsed, done after the chunks are merged.
+        struct etsl_deferred_check {
+            const etsl_token* token;
+
+            // Index of the category of the attribute in the chunk.
+            size_t category;
+
+            // Comparison to check, or a range or values declaration (with
+            // keyword "range" or "values") that must not be in Expectations.
+            etsl_comparison comparison;
+            std::string keyword;
+        };
+
         class etsl_parser {
         private:
             etsl_file& file_;
-            const std::vector<etsl_token>& tokens_;
             bool mutually_exclusive_choices_ = false;
+
+            // If set, the checks depending on the categories before the
+            // chunk are appended to it instead.
+            std::vector<etsl_deferred_check>* deferred_checks_;
+            const etsl_token* error_token_ = nullptr;
+
+            // Sub-specs imported by the choices of the current category,
+            // which are spliced in after it, and whether the current
+            // category was replaced by imported ones.
+            struct pending_import {
+                etsl_loaded_import sub;
+                std::string guard_prop;
+            };
+            etsl_import_loader loader_;
+            std::vector<pending_import> pending_imports_;
+            bool imported_category_ = false;
+
             enum {
                 attr_state_init,
                 attr_state_if,
@@ -39,8 +87,12 @@ namespace etsl {
         private:
             void parse_category(const etsl_token& token)
             {
+                flush_imports();
+                imported_category_ = false;
+
                 if (!file_.categories.empty()
-                    && file_.categories.back().choices.empty()) {
+                    && file_.categories.back().choices.empty()
+                    && !file_.categories.back().has_domain()) {
                     if (file_.categories.back().name == "Expectations") {
                         // We are now in the Expectations section.
                         mutually_exclusive_choices_ = true;
@@ -58,9 +110,300 @@ namespace etsl {
                                             "unexpected choice");
                 }
                 auto& category = file_.categories.back();
+                if (category.has_domain() || imported_category_) {
+                    throw etsl_syntax_error(token.line_num, token.col_num,
+                                            "unexpected choice");
+                }
                 category.choices.emplace_back(token.str);
             }
 
+            static bool parse_integer(const std::string& s, long long& n)
+            {
+                try {
+                    size_t pos;
+                    n = std::stoll(s, &pos);
+                    return pos == s.size();
+                }
+                catch (std::logic_error&) {
+                    return false;
+                }
+            }
+
+            // Parses [range first..last] or [values a, b, ...] declaring the
+            // choices of the current category.
+            void parse_domain(const etsl_token& token,
+                              const std::vector<std::string>& attr_subtokens)
+            {
+                auto& category = file_.categories.back();
+                if (!category.choices.empty() || category.has_domain()) {
+                    throw etsl_syntax_error(token.line_num, token.col_num,
+                                            "unexpected attribute");
+                }
+                if (category.mutually_exclusive) {
+                    throw etsl_syntax_error(token.line_num, token.col_num,
+                                            "unexpected " + attr_subtokens[0]
+                                                    + " in Expectations");
+                }
+                if (deferred_checks_ != nullptr) {
+                    deferred_checks_->push_back(
+                            {&token, file_.categories.size() - 1, {},
+                             attr_subtokens[0]});
+                }
+
+                auto& domain = category.domain;
+                if (attr_subtokens[0] == "range") {
+                    auto invalid = [&] {
+                        return etsl_syntax_error(token.line_num, token.col_num,
+                                                 "invalid range");
+                    };
+                    if (attr_subtokens.size() != 2) {
+                        throw invalid();
+                    }
+                    const std::string& str = attr_subtokens[1];
+                    size_t dots = str.find("..");
+                    if (dots == std::string::npos
+                        || !parse_integer(str.substr(0, dots), domain.first)
+                        || !parse_integer(str.substr(dots + 2), domain.last)
+                        || domain.first > domain.last
+                        || static_cast<unsigned long long>(domain.last)
+                                        - static_cast<unsigned long long>(
+                                                  domain.first)
+                                >= std::numeric_limits<int>::max()) {
+                        throw invalid();
+                    }
+                    domain.kind = etsl_domain::kind_range;
+                }
+                else {
+                    auto it = begin(attr_subtokens) + 1;
+                    const auto it_end = end(attr_subtokens);
+                    attr_assert(token, [&] { return it != it_end; });
+                    while (it != it_end) {
+                        attr_assert(token, [&] { return *it != ","; });
+                        if (std::find(begin(domain.values), end(domain.values),
+                                      *it)
+                            != end(domain.values)) {
+                            throw etsl_syntax_error(token.line_num,
+                                                    token.col_num,
+                                                    "duplicate value " + *it);
+                        }
+                        domain.values.push_back(*it);
+                        ++it;
+                        if (it == it_end) {
+                            break;
+                        }
+
+                        attr_assert(token, [&] { return *it == ","; });
+                        ++it;
+                        attr_assert(token, [&] { return it != it_end; });
+                    }
+                    domain.kind = etsl_domain::kind_values;
+                }
+            }
+
+            // Appends the categories of the sub-spec, which can only be
+            // selected along with the guard property if any.
+            void splice(const etsl_loaded_import& sub,
+                        const std::string& guard_prop)
+            {
+                const size_t first = file_.categories.size();
+                const size_t import_index = file_.imports.size();
+                file_.imports.push_back({sub.path, sub.hash, first, first});
+
+                for (const auto& cat : sub.file->categories) {
+                    // Drop the empty category the sub-spec may end with.
+                    if (cat.choices.empty() && !cat.has_domain()) {
+                        continue;
+                    }
+                    file_.categories.push_back(cat);
+                    auto& c = file_.categories.back();
+                    c.mutually_exclusive |= mutually_exclusive_choices_;
+                    if (!guard_prop.empty()) {
+                        c.guard_props.push_back(guard_prop);
+                    }
+                }
+
+                const size_t last = file_.categories.size();
+                file_.imports[import_index].last = last;
+                for (const auto& imp : sub.file->imports) {
+                    file_.imports.push_back({imp.path, imp.hash,
+                                             std::min(first + imp.first, last),
+                                             std::min(first + imp.last, last)});
+                }
+            }
+
+            void flush_imports()
+            {
+                for (const auto& p : pending_imports_) {
+                    splice(p.sub, p.guard_prop);
+                }
+                pending_imports_.clear();
+            }
+
+            // Parses [import path]. On its own, the category is replaced by
+            // the categories of the sub-spec. After a choice, they follow the
+            // category and are <n/a> unless the choice is selected.
+            void parse_import(const etsl_token& token,
+                              const std::vector<std::string>& attr_subtokens)
+            {
+                attr_assert(token, [&] { return attr_subtokens.size() == 2; });
+                auto& category = file_.categories.back();
+                bool whole_category = imported_category_
+                        || (category.choices.empty() && !category.has_domain());
+                if ((category.has_domain() && !imported_category_)
+                    || !loader_) {
+                    throw etsl_syntax_error(token.line_num, token.col_num,
+                                            "unexpected import");
+                }
+
+                const std::string& path = attr_subtokens[1];
+                etsl_loaded_import sub;
+                try {
+                    sub = loader_(path);
+                }
+                catch (etsl_syntax_error& e) {
+                    throw etsl_syntax_error(
+                            token.line_num, token.col_num,
+                            path + ":" + std::to_string(e.line_num) + ":"
+                                    + std::to_string(e.col_num) + ": "
+                                    + e.what());
+                }
+                catch (std::runtime_error& e) {
+                    throw etsl_syntax_error(token.line_num, token.col_num,
+                                            e.what());
+                }
+
+                if (whole_category) {
+                    if (!imported_category_) {
+                        file_.categories.pop_back();
+                        imported_category_ = true;
+                    }
+                    splice(sub, "");
+                }
+                else {
+                    pending_imports_.push_back(
+                            {std::move(sub), category.name + ":"
+                                                     + category.choices.back()
+                                                               .name});
+                }
+            }
+
+            // Returns the position of the operand of the comparison among
+            // the choices of the category, clamped to -1 and size for a range.
+            static long long operand_index(const etsl_domain& domain,
+                                           const etsl_comparison& cmp)
+            {
+                if (domain.kind == etsl_domain::kind_values) {
+                    return std::find(begin(domain.values), end(domain.values),
+                                     cmp.operand)
+                            - begin(domain.values);
+                }
+
+                long long n = 0;
+                parse_integer(cmp.operand, n);
+                n = std::min(std::max(n, domain.first - 1), domain.last + 1);
+                return n - domain.first;
+            }
+
+            // Checks the comparison against the first num_categories
+            // categories.
+            void check_comparison(const etsl_token& token,
+                                  const etsl_comparison& cmp,
+                                  size_t num_categories)
+            {
+                auto cats_end = begin(file_.categories) + num_categories;
+                auto it = std::find_if(
+                        begin(file_.categories), cats_end,
+                        [&](const etsl_category& cat) {
+                            return cat.has_domain() && cat.name == cmp.category;
+                        });
+                if (it == cats_end) {
+                    throw etsl_syntax_error(token.line_num, token.col_num,
+                                            "no range or values category "
+                                                    + cmp.category);
+                }
+
+                long long n;
+                bool valid = it->domain.kind == etsl_domain::kind_range
+                        ? parse_integer(cmp.operand, n)
+                        : (cmp.op == "==" || cmp.op == "!=")
+                                && operand_index(it->domain, cmp)
+                                        < static_cast<long long>(
+                                                  it->domain.size());
+                if (!valid) {
+                    throw etsl_syntax_error(token.line_num, token.col_num,
+                                            "invalid comparison "
+                                                    + cmp.prop_name);
+                }
+            }
+
+            // Splits the choices of each range or values category into runs
+            // with the same comparison results so that they are never
+            // materialized one by one.
+            void add_value_classes()
+            {
+                std::vector<etsl_comparison> comparisons;
+                for (const etsl_category& cat : file_.categories) {
+                    for (const etsl_choice& ch : cat.choices) {
+                        if (ch.has_if) {
+                            ch.cond.collect_comparisons(comparisons);
+                        }
+                    }
+                }
+
+                for (etsl_category& cat : file_.categories) {
+                    if (!cat.has_domain()) {
+                        continue;
+                    }
+                    auto& domain = cat.domain;
+                    long long size = domain.size();
+
+                    // An imported category was split for its own spec.
+                    domain.classes.clear();
+
+                    std::vector<std::pair<const etsl_comparison*, long long>>
+                            cat_comparisons;
+                    std::vector<long long> cuts = {0, size};
+                    for (const auto& cmp : comparisons) {
+                        if (cmp.category != cat.name) {
+                            continue;
+                        }
+                        long long i = operand_index(domain, cmp);
+                        cat_comparisons.emplace_back(&cmp, i);
+                        if (cmp.op != "<" && cmp.op != ">=") {
+                            cuts.push_back(i + 1);
+                        }
+                        if (cmp.op != "<=" && cmp.op != ">") {
+                            cuts.push_back(i);
+                        }
+                    }
+                    for (auto& c : cuts) {
+                        c = std::min(std::max(c, 0ll), size);
+                    }
+                    unique_sort(cuts);
+
+                    for (size_t k = 0; k + 1 < cuts.size(); ++k) {
+                        etsl_domain::value_class vc;
+                        vc.first = cuts[k];
+                        vc.last = cuts[k + 1];
+                        for (const auto& p : cat_comparisons) {
+                            const std::string& op = p.first->op;
+                            long long a = vc.first;
+                            long long b = p.second;
+                            bool holds = op == "<" ? a < b
+                                    : op == "<=" ? a <= b
+                                    : op == ">" ? a > b
+                                    : op == ">=" ? a >= b
+                                    : op == "==" ? a == b : a != b;
+                            if (holds) {
+                                vc.props.push_back(p.first->prop_name);
+                            }
+                        }
+                        unique_sort(vc.props);
+                        domain.classes.push_back(std::move(vc));
+                    }
+                }
+            }
+
             template <typename F>
             void attr_assert(const etsl_token& token, F pred)
             {
@@ -72,15 +415,32 @@ namespace etsl {
 
             void parse_attribute(const etsl_token& token)
             {
-                if (file_.categories.empty()
-                    || file_.categories.back().choices.empty()) {
+                if (file_.categories.empty()) {
                     throw etsl_syntax_error(token.line_num, token.col_num,
                                             "unexpected attribute");
                 }
-                etsl_choice& choice = file_.categories.back().choices.back();
 
                 auto attr_subtokens = etsl_attr_subtokenize(token);
                 attr_assert(token, [&] { return !attr_subtokens.empty(); });
+                if (attr_subtokens[0] == "import") {
+                    parse_import(token, attr_subtokens);
+                    return;
+                }
+                if (imported_category_) {
+                    throw etsl_syntax_error(token.line_num, token.col_num,
+                                            "unexpected attribute");
+                }
+                if (attr_subtokens[0] == "range"
+                    || attr_subtokens[0] == "values") {
+                    parse_domain(token, attr_subtokens);
+                    return;
+                }
+
+                if (file_.categories.back().choices.empty()) {
+                    throw etsl_syntax_error(token.line_num, token.col_num,
+                                            "unexpected attribute");
+                }
+                etsl_choice& choice = file_.categories.back().choices.back();
 
                 const auto it_end = end(attr_subtokens);
                 auto it = begin(attr_subtokens);
@@ -99,6 +459,20 @@ namespace etsl {
                                                 ex.what());
                     }
                     choice.has_if = true;
+
+                    std::vector<etsl_comparison> comparisons;
+                    choice.cond.collect_comparisons(comparisons);
+                    for (const auto& cmp : comparisons) {
+                        if (deferred_checks_ != nullptr) {
+                            deferred_checks_->push_back(
+                                    {&token, file_.categories.size() - 1, cmp,
+                                     ""});
+                        }
+                        else {
+                            check_comparison(token, cmp,
+                                             file_.categories.size());
+                        }
+                    }
                 }
                 else if (keyword == "else") {
                     attr_assert(token,
@@ -148,29 +522,82 @@ namespace etsl {
             }
 
         public:
-            etsl_parser(etsl_file& file, const std::vector<etsl_token>& tokens)
-                    : file_(file), tokens_(tokens)
+            // Without a loader, imports are syntax errors.
+            explicit etsl_parser(
+                    etsl_file& file,
+                    std::vector<etsl_deferred_check>* deferred_checks = nullptr,
+                    etsl_import_loader loader = nullptr)
+                    : file_(file),
+                      deferred_checks_(deferred_checks),
+                      loader_(std::move(loader))
             {
-                for (const auto& t : tokens_) {
-                    switch (t.kind) {
-                    case etsl_token::kind_category:
-                        parse_category(t);
-                        break;
-                    case etsl_token::kind_choice:
-                        parse_choice(t);
-                        attr_state_ = attr_state_init;
-                        break;
-                    case etsl_token::kind_attribute:
-                        parse_attribute(t);
-                        break;
-                    default:
-                        throw etsl_syntax_error(t.line_num, t.col_num,
-                                                "invalid token");
+            }
+
+            // Parses the tokens into categories appended to the file. On a
+            // syntax error, error_token() is the token in error.
+            void parse(const etsl_token* first, const etsl_token* last)
+            {
+                for (const etsl_token* t = first; t != last; ++t) {
+                    try {
+                        switch (t->kind) {
+                        case etsl_token::kind_category:
+                            parse_category(*t);
+                            break;
+                        case etsl_token::kind_choice:
+                            parse_choice(*t);
+                            attr_state_ = attr_state_init;
+                            break;
+                        case etsl_token::kind_attribute:
+                            parse_attribute(*t);
+                            break;
+                        default:
+                            throw etsl_syntax_error(t->line_num, t->col_num,
+                                                    "invalid token");
+                        }
+                    }
+                    catch (etsl_syntax_error&) {
+                        error_token_ = t;
+                        throw;
                     }
                 }
+                flush_imports();
+            }
 
-                // Add automatic properties.
-                for (etsl_category& cat : file_.categories) {
+            const etsl_token* error_token() const
+            {
+                return error_token_;
+            }
+
+            // Whether the categories parsed last are in the Expectations
+            // section.
+            bool mutually_exclusive_choices() const
+            {
+                return mutually_exclusive_choices_;
+            }
+
+            // Does a deferred check of the chunk whose first category is at
+            // category_offset in the file.
+            void check(const etsl_deferred_check& c, size_t category_offset)
+            {
+                size_t cat = category_offset + c.category;
+                const etsl_token& token = *c.token;
+                if (!c.keyword.empty()) {
+                    if (file_.categories[cat].mutually_exclusive) {
+                        throw etsl_syntax_error(token.line_num, token.col_num,
+                                                "unexpected " + c.keyword
+                                                        + " in Expectations");
+                    }
+                }
+                else {
+                    check_comparison(token, c.comparison, cat + 1);
+                }
+            }
+
+            // Adds the automatic properties to the categories from first on.
+            void add_automatic_props(size_t first = 0)
+            {
+                for (size_t i = first; i < file_.categories.size(); ++i) {
+                    etsl_category& cat = file_.categories[i];
                     for (etsl_choice& ch : cat.choices) {
                         ch.if_props.push_back(cat.name + ":" + ch.name);
                         ch.else_props.push_back(cat.name + ":" + ch.name);
@@ -180,23 +607,31 @@ namespace etsl {
                             ch.if_props.push_back(cat.name);
                             ch.else_props.push_back(cat.name);
                         }
-                    }
-                }
 
-                for (etsl_category& cat : file_.categories) {
-                    for (etsl_choice& ch : cat.choices) {
                         unique_sort(ch.if_props);
                         unique_sort(ch.else_props);
                     }
                 }
             }
+
+            // Completes the file after all the categories are parsed.
+            void finish()
+            {
+                add_value_classes();
+                file_.plan = compile_etsl_plan(file_);
+            }
         };
     }
 
-    etsl_file etsl_parse(const std::vector<etsl_token>& tokens)
+    // The sub-specs imported are loaded by the loader.
+    inline etsl_file etsl_parse(const std::vector<etsl_token>& tokens,
+                                etsl_import_loader loader = nullptr)
     {
         etsl_file file;
-        detail::etsl_parser(file, tokens);
+        detail::etsl_parser parser(file, nullptr, std::move(loader));
+        parser.parse(tokens.data(), tokens.data() + tokens.size());
+        parser.add_automatic_props();
+        parser.finish();
         return file;
     }
 }
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2017, Yutaka Tsutano
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ETSL_PLAN_HPP
+#define ETSL_PLAN_HPP
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+namespace etsl {
+    namespace details {
+        // Compact form of an etsl_file that the enumeration engines run on.
+        // The fields needed to select choices are packed into parallel
+        // arrays indexed by category, choice, or value class so that they
+        // stay in cache; the names are left in the etsl_file. Choices and
+        // value classes are numbered across all the categories.
+        struct etsl_plan {
+            enum : std::uint8_t {
+                category_mutually_exclusive = 1,
+
+                // Whether the category is <n/a> unless its guard holds.
+                category_has_guard = 2
+            };
+
+            enum : std::uint8_t {
+                choice_has_if = 1,
+                choice_has_else = 2,
+
+                // Whether the choice can be selected without an if, when
+                // the if condition holds, and when it does not.
+                choice_selectable = 4,
+                choice_if_selectable = 8,
+                choice_else_selectable = 16
+            };
+
+            // Node of the predicate DAG. The predicates are normalized and
+            // their common subexpressions shared: nested ANDs and ORs are
+            // flattened, their operands sorted by node, and equal nodes
+            // merged. The operands of a node come before it.
+            struct node {
+                enum : std::uint8_t { prop, op_not, op_and, op_or } op;
+
+                // Property id of a prop node, or the operands [first, last)
+                // of node_operands otherwise.
+                std::uint32_t first;
+                std::uint32_t last;
+
+                // Last category whose choices can set a property the node
+                // refers to (-1 for none). The value of the node only depends
+                // on the choices selected up to that category.
+                int level;
+            };
+
+            // The choices of category c are [choice_begin[c],
+            // choice_begin[c + 1]) and its value classes are [class_begin[c],
+            // class_begin[c + 1]).
+            std::vector<std::uint32_t> choice_begin = {0};
+            std::vector<std::uint32_t> class_begin = {0};
+            std::vector<std::uint8_t> category_flags;
+            std::vector<std::uint32_t> category_guard;
+
+            // The properties set by each choice are given as property sets,
+            // and its condition as a node if it has one.
+            std::vector<std::uint8_t> choice_flags;
+            std::vector<std::uint32_t> choice_if_props;
+            std::vector<std::uint32_t> choice_else_props;
+            std::vector<std::uint32_t> choice_cond;
+
+            // Runs of choices of range and values categories.
+            std::vector<int> class_first;
+            std::vector<int> class_count;
+            std::vector<std::uint32_t> class_props;
+
+            // Property set s is [prop_set_begin[s], prop_set_begin[s + 1]) of
+            // prop_set_ids. Set 0 is empty. Only the properties referred to by
+            // a predicate are kept.
+            std::vector<std::uint32_t> prop_set_begin = {0, 0};
+            std::vector<std::uint32_t> prop_set_ids;
+
+            std::vector<node> nodes;
+            std::vector<std::uint32_t> node_operands;
+
+            // Names of the properties by id.
+            std::vector<std::string> prop_names;
+
+            size_t num_categories() const
+            {
+                return category_flags.size();
+            }
+
+            size_t num_props() const
+            {
+                return prop_names.size();
+            }
+
+            // Appends the ids of the properties the node refers to.
+            void collect_props(std::uint32_t n,
+                               std::vector<std::uint32_t>& ids) const
+            {
+                if (nodes[n].op == node::prop) {
+                    ids.push_back(nodes[n].first);
+                    return;
+                }
+                for (auto i = nodes[n].first; i < nodes[n].last; ++i) {
+                    collect_props(node_operands[i], ids);
+                }
+            }
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2017, Yutaka Tsutano
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ETSL_PLAN_COMPILER_HPP
+#define ETSL_PLAN_COMPILER_HPP
+
+#include <vector>
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+
+#include "etsl_file.hpp"
+#include "etsl_plan.hpp"
+#include "algorithm.hpp"
+
+namespace etsl {
+    namespace details {
+        class etsl_plan_compiler {
+        private:
+            using node = etsl_plan::node;
+
+            // Operand of a node being built: either a node, or an AND or OR
+            // whose operands may still be merged into an enclosing one.
+            struct term {
+                std::uint8_t op;
+                std::vector<std::uint32_t> operands;
+            };
+
+            etsl_plan& plan_;
+            std::unordered_map<std::string, std::uint32_t> prop_ids_;
+            std::map<std::vector<std::uint32_t>, std::uint32_t> prop_sets_;
+            std::map<std::pair<std::uint8_t, std::vector<std::uint32_t>>,
+                     std::uint32_t>
+                    node_ids_;
+
+            // Last category setting each property (-1 for none).
+            std::vector<int> prop_levels_;
+
+        private:
+            std::uint32_t intern_node(std::uint8_t op,
+                                      std::vector<std::uint32_t> operands)
+            {
+                auto key = std::make_pair(op, std::move(operands));
+                auto it = node_ids_.find(key);
+                if (it != end(node_ids_)) {
+                    return it->second;
+                }
+
+                node n;
+                n.op = static_cast<decltype(n.op)>(op);
+                n.level = -1;
+                if (op == node::prop) {
+                    n.first = key.second[0];
+                    n.last = n.first + 1;
+                }
+                else {
+                    n.first = plan_.node_operands.size();
+                    plan_.node_operands.insert(end(plan_.node_operands),
+                                               begin(key.second),
+                                               end(key.second));
+                    n.last = plan_.node_operands.size();
+                }
+
+                std::uint32_t id = plan_.nodes.size();
+                plan_.nodes.push_back(n);
+                node_ids_.emplace(std::move(key), id);
+                return id;
+            }
+
+            std::uint32_t to_node(term t)
+            {
+                if (t.op == node::prop) {
+                    return t.operands[0];
+                }
+
+                // AND and OR are idempotent and commutative.
+                unique_sort(t.operands);
+                if (t.operands.size() == 1) {
+                    return t.operands[0];
+                }
+                return intern_node(t.op, std::move(t.operands));
+            }
+
+            std::uint32_t prop_node(const std::string& prop)
+            {
+                auto it = prop_ids_.find(prop);
+                if (it == end(prop_ids_)) {
+                    it = prop_ids_.emplace(prop, prop_ids_.size()).first;
+                    plan_.prop_names.push_back(prop);
+                }
+                return intern_node(node::prop, {it->second});
+            }
+
+            std::uint32_t compile_predicate(const etsl_predicate& cond)
+            {
+                // Terms whose op is prop hold a finished node.
+                std::vector<term> stack;
+                cond.to_postfix(
+                        [&](const std::string& prop) {
+                            stack.push_back({node::prop, {prop_node(prop)}});
+                        },
+                        [&](const std::string& op) {
+                            if (op == "!") {
+                                auto n = to_node(std::move(stack.back()));
+                                stack.back().op = node::prop;
+                                stack.back().operands = {
+                                        plan_.nodes[n].op == node::op_not
+                                                ? plan_.node_operands
+                                                          [plan_.nodes[n].first]
+                                                : intern_node(node::op_not,
+                                                              {n})};
+                                return;
+                            }
+
+                            // Flatten the operands with the same op.
+                            std::uint8_t o = op == "&&" ? node::op_and
+                                                        : node::op_or;
+                            term t = {o, {}};
+                            for (size_t k = stack.size() - 2; k < stack.size();
+                                 ++k) {
+                                if (stack[k].op == o) {
+                                    t.operands.insert(end(t.operands),
+                                                      begin(stack[k].operands),
+                                                      end(stack[k].operands));
+                                    continue;
+                                }
+                                auto n = to_node(std::move(stack[k]));
+                                if (plan_.nodes[n].op == o) {
+                                    t.operands.insert(
+                                            end(t.operands),
+                                            begin(plan_.node_operands)
+                                                    + plan_.nodes[n].first,
+                                            begin(plan_.node_operands)
+                                                    + plan_.nodes[n].last);
+                                }
+                                else {
+                                    t.operands.push_back(n);
+                                }
+                            }
+                            stack.pop_back();
+                            stack.back() = std::move(t);
+                        });
+                return to_node(std::move(stack.back()));
+            }
+
+            // Returns the set of the properties referred to by predicates,
+            // which are set by the category at the level.
+            std::uint32_t intern_props(const std::vector<std::string>& props,
+                                       int level)
+            {
+                std::vector<std::uint32_t> ids;
+                for (const auto& s : props) {
+                    auto it = prop_ids_.find(s);
+                    if (it != end(prop_ids_)) {
+                        ids.push_back(it->second);
+                        prop_levels_[it->second] = level;
+                    }
+                }
+                unique_sort(ids);
+
+                auto it = prop_sets_.find(ids);
+                if (it != end(prop_sets_)) {
+                    return it->second;
+                }
+
+                std::uint32_t s = plan_.prop_set_begin.size() - 1;
+                plan_.prop_set_ids.insert(end(plan_.prop_set_ids), begin(ids),
+                                          end(ids));
+                plan_.prop_set_begin.push_back(plan_.prop_set_ids.size());
+                prop_sets_.emplace(std::move(ids), s);
+                return s;
+            }
+
+        public:
+            etsl_plan_compiler(etsl_plan& plan, const etsl_file& file)
+                    : plan_(plan)
+            {
+                prop_sets_.emplace(std::vector<std::uint32_t>(), 0);
+
+                // Compile the conditions and guards first so that the
+                // properties they refer to have ids.
+                for (const auto& cat : file.categories) {
+                    term guard = {node::op_and, {}};
+                    for (const auto& prop : cat.guard_props) {
+                        guard.operands.push_back(prop_node(prop));
+                    }
+                    plan_.category_guard.push_back(
+                            guard.operands.empty() ? 0
+                                                   : to_node(std::move(guard)));
+
+                    for (const auto& ch : cat.choices) {
+                        plan_.choice_cond.push_back(
+                                ch.has_if ? compile_predicate(ch.cond) : 0);
+                    }
+                }
+                prop_levels_.assign(plan_.num_props(), -1);
+
+                int level = 0;
+                for (const auto& cat : file.categories) {
+                    std::uint8_t cat_flags = 0;
+                    if (cat.mutually_exclusive) {
+                        cat_flags |= etsl_plan::category_mutually_exclusive;
+                    }
+                    if (!cat.guard_props.empty()) {
+                        cat_flags |= etsl_plan::category_has_guard;
+                    }
+                    plan_.category_flags.push_back(cat_flags);
+
+                    for (const auto& ch : cat.choices) {
+                        std::uint8_t flags = 0;
+                        if (ch.has_if) {
+                            flags |= etsl_plan::choice_has_if;
+                        }
+                        if (ch.has_else) {
+                            flags |= etsl_plan::choice_has_else;
+                        }
+                        if (ch.single_str.empty()) {
+                            flags |= etsl_plan::choice_selectable;
+                            if (ch.if_single_str.empty()) {
+                                flags |= etsl_plan::choice_if_selectable;
+                            }
+                            if (ch.else_single_str.empty()) {
+                                flags |= etsl_plan::choice_else_selectable;
+                            }
+                        }
+                        plan_.choice_flags.push_back(flags);
+                        plan_.choice_if_props.push_back(
+                                intern_props(ch.if_props, level));
+                        plan_.choice_else_props.push_back(
+                                intern_props(ch.else_props, level));
+                    }
+                    plan_.choice_begin.push_back(plan_.choice_flags.size());
+
+                    for (const auto& vc : cat.domain.classes) {
+                        plan_.class_first.push_back(vc.first);
+                        plan_.class_count.push_back(vc.last - vc.first);
+                        plan_.class_props.push_back(
+                                intern_props(vc.props, level));
+                    }
+                    plan_.class_begin.push_back(plan_.class_first.size());
+                    ++level;
+                }
+
+                // The operands of a node come before it.
+                for (auto& n : plan_.nodes) {
+                    if (n.op == node::prop) {
+                        n.level = prop_levels_[n.first];
+                        continue;
+                    }
+                    for (auto i = n.first; i < n.last; ++i) {
+                        n.level = std::max(
+                                n.level,
+                                plan_.nodes[plan_.node_operands[i]].level);
+                    }
+                }
+            }
+        };
+    }
+
+    // Lowers the file into the plan the enumeration engines run on.
+    inline details::etsl_plan compile_etsl_plan(const etsl_file& file)
+    {
+        details::etsl_plan plan;
+        details::etsl_plan_compiler(plan, file);
+        return plan;
+    }
+}
+
+#endif
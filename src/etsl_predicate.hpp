@@ -19,17 +19,36 @@
 
 #include <vector>
 #include <memory>
+#include <string>
+#include <stdexcept>
 
 namespace etsl {
     struct etsl_invalid_predicate_error : std::runtime_error {
         using runtime_error::runtime_error;
     };
 
+    // Comparison of the value of a range or values category (e.g., size < 64).
+    // It is true when the property named prop_name is set, which the choices
+    // of the category set lazily.
+    struct etsl_comparison {
+        std::string category;
+        std::string op;
+        std::string operand;
+        std::string prop_name;
+    };
+
+    inline bool is_comparison_operator(const std::string& s)
+    {
+        return s == "<" || s == "<=" || s == ">" || s == ">=" || s == "=="
+                || s == "!=";
+    }
+
     class etsl_predicate {
     private:
         struct expression {
-            enum { kind_and, kind_or, kind_not, kind_prop } kind;
+            enum { kind_and, kind_or, kind_not, kind_prop, kind_compare } kind;
             std::string prop_name;
+            etsl_comparison comparison;
             std::unique_ptr<expression> operands[2];
         };
 
@@ -43,7 +62,7 @@ namespace etsl {
         //
         // <primary> ::= "!" <primary>
         //             | "(" <expression> ")"
-        //             | <prop>
+        //             | <prop> ( <comparison_op> <operand> )?
 
         template <typename I>
         std::unique_ptr<expression> parse_expr(I& first, I last)
@@ -139,6 +158,25 @@ namespace etsl {
                 expr->kind = expression::kind_prop;
                 expr->prop_name = *first;
                 ++first;
+
+                if (first != last && is_comparison_operator(*first)) {
+                    auto& cmp = expr->comparison;
+                    cmp.category = expr->prop_name;
+                    cmp.op = *first;
+                    ++first;
+                    if (first == last || is_comparison_operator(*first)
+                        || *first == "(" || *first == ")" || *first == "!"
+                        || *first == "&&" || *first == "||") {
+                        throw etsl_invalid_predicate_error(
+                                "invalid operator " + cmp.op);
+                    }
+                    cmp.operand = *first;
+                    ++first;
+
+                    cmp.prop_name = cmp.category + cmp.op + cmp.operand;
+                    expr->kind = expression::kind_compare;
+                    expr->prop_name = cmp.prop_name;
+                }
                 return expr;
             }
 
@@ -150,6 +188,7 @@ namespace etsl {
         {
             switch (expr->kind) {
             case expression::kind_prop:
+            case expression::kind_compare:
                 os << expr->prop_name;
                 break;
             case expression::kind_not:
@@ -174,6 +213,61 @@ namespace etsl {
             }
         }
 
+        void collect_props(std::vector<std::string>& props,
+                           const std::unique_ptr<expression>& expr) const
+        {
+            if (expr == nullptr) {
+                return;
+            }
+
+            if (expr->kind == expression::kind_prop
+                || expr->kind == expression::kind_compare) {
+                props.push_back(expr->prop_name);
+            }
+            collect_props(props, expr->operands[0]);
+            collect_props(props, expr->operands[1]);
+        }
+
+        void collect_comparisons(std::vector<etsl_comparison>& comparisons,
+                                 const std::unique_ptr<expression>& expr) const
+        {
+            if (expr == nullptr) {
+                return;
+            }
+
+            if (expr->kind == expression::kind_compare) {
+                comparisons.push_back(expr->comparison);
+            }
+            collect_comparisons(comparisons, expr->operands[0]);
+            collect_comparisons(comparisons, expr->operands[1]);
+        }
+
+        template <typename P, typename O>
+        void to_postfix(const std::unique_ptr<expression>& expr,
+                        const P& on_prop, const O& on_op) const
+        {
+            switch (expr->kind) {
+            case expression::kind_prop:
+            case expression::kind_compare:
+                on_prop(expr->prop_name);
+                break;
+            case expression::kind_not:
+                to_postfix(expr->operands[0], on_prop, on_op);
+                on_op("!");
+                break;
+            case expression::kind_and:
+                to_postfix(expr->operands[0], on_prop, on_op);
+                to_postfix(expr->operands[1], on_prop, on_op);
+                on_op("&&");
+                break;
+            case expression::kind_or:
+                to_postfix(expr->operands[0], on_prop, on_op);
+                to_postfix(expr->operands[1], on_prop, on_op);
+                on_op("||");
+                break;
+            }
+        }
+
         template <typename F>
         bool evaluate(const std::unique_ptr<expression>& expr,
                       const F& prop_map) const
@@ -184,6 +278,7 @@ namespace etsl {
 
             switch (expr->kind) {
             case expression::kind_prop:
+            case expression::kind_compare:
                 return prop_map(expr->prop_name);
             case expression::kind_not:
                 return !evaluate(expr->operands[0], prop_map);
@@ -198,7 +293,38 @@ namespace etsl {
             return false;
         }
 
+        static std::unique_ptr<expression>
+        clone(const std::unique_ptr<expression>& expr)
+        {
+            if (expr == nullptr) {
+                return nullptr;
+            }
+
+            std::unique_ptr<expression> copy(new expression);
+            copy->kind = expr->kind;
+            copy->prop_name = expr->prop_name;
+            copy->comparison = expr->comparison;
+            for (int i = 0; i < 2; ++i) {
+                copy->operands[i] = clone(expr->operands[i]);
+            }
+            return copy;
+        }
+
     public:
+        etsl_predicate() = default;
+        etsl_predicate(etsl_predicate&&) = default;
+
+        // Copies are deep, as for the choices of an imported sub-spec.
+        etsl_predicate(const etsl_predicate& other) : expr_(clone(other.expr_))
+        {
+        }
+
+        etsl_predicate& operator=(etsl_predicate other)
+        {
+            expr_ = std::move(other.expr_);
+            return *this;
+        }
+
         friend std::ostream& operator<<(std::ostream& os,
                                         const etsl_predicate& pred)
         {
@@ -215,6 +341,28 @@ namespace etsl {
             }
         }
 
+        // Appends the names of the properties the predicate refers to.
+        void collect_props(std::vector<std::string>& props) const
+        {
+            collect_props(props, expr_);
+        }
+
+        // Appends the comparisons in the predicate.
+        void collect_comparisons(std::vector<etsl_comparison>& comparisons) const
+        {
+            collect_comparisons(comparisons, expr_);
+        }
+
+        // Calls on_prop with the name of each property and on_op with each
+        // operator ("!", "&&" or "||") in postfix order.
+        template <typename P, typename O>
+        void to_postfix(const P& on_prop, const O& on_op) const
+        {
+            if (expr_ != nullptr) {
+                to_postfix(expr_, on_prop, on_op);
+            }
+        }
+
         template <typename F>
         bool operator()(const F& prop_map) const
         {
@@ -0,0 +1,671 @@
+/*
+ * Copyright (c) 2017, Yutaka Tsutano
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ETSL_SERVER_HPP
+#define ETSL_SERVER_HPP
+
+// Request protocol
+// ================
+//
+// A request is a line of words separated by whitespace:
+//
+//     generate [-g] input_file [output_file]
+//     count input_file
+//     frame input_file key
+//
+// A word with whitespace in it, such as a path, is quoted with double quotes,
+// in which \" and \\ stand for " and \.
+//
+// The response is either
+//
+//     ok size\n
+//     (size bytes of payload)
+//
+// or
+//
+//     error message\n
+//
+// generate writes the frames to output_file (input_file.tsl by default), or
+// sends them as the payload if output_file is "-". The payload is then sent
+// as the frames are written, after its size computed from the frame counts;
+// if it cannot be completed, the connection is closed. count sends the number
+// of frames followed by a newline. frame sends the frame with the given key as
+// written in the frame headings.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <future>
+#include <chrono>
+#include <ctime>
+#include <cctype>
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "etsl.hpp"
+#include "algorithm.hpp"
+#include "etsl_thread_pool.hpp"
+
+namespace etsl {
+    // Parsed specs by path. A spec is reparsed only when the content of the
+    // file or of a sub-spec it imports has changed. The files are read and
+    // parsed outside the lock, and the requests for a spec being parsed wait
+    // for the same parse.
+    class etsl_spec_cache {
+    private:
+        struct imported_file {
+            std::string path;
+            std::time_t mtime;
+            off_t size;
+            std::time_t checked_at;
+            unsigned long long hash;
+        };
+
+        struct parsed_spec {
+            unsigned long long hash;
+            std::vector<imported_file> imports;
+            std::shared_ptr<const etsl_spec> spec;
+        };
+
+        using parsed_future = std::shared_future<
+                std::shared_ptr<const parsed_spec>>;
+
+        struct entry {
+            unsigned long long id;
+            std::time_t mtime;
+            off_t size;
+            std::time_t checked_at;
+            parsed_future parsed;
+        };
+
+        std::unordered_map<std::string, entry> entries_;
+        unsigned long long next_id_ = 0;
+        std::mutex mutex_;
+
+    private:
+        // Whether the sub-specs imported are unchanged judging by their
+        // mtime and size, which they are not if they were last modified
+        // within the second they were checked.
+        static bool imports_unchanged(const parsed_spec& p)
+        {
+            for (const auto& imp : p.imports) {
+                struct stat st;
+                if (stat(imp.path.c_str(), &st) != 0
+                    || st.st_mtime != imp.mtime || st.st_size != imp.size
+                    || imp.mtime >= imp.checked_at) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // Returns the parsed spec with its imports checked again, those
+        // modified within the second they were checked by their content, or
+        // nullptr if any has changed.
+        static std::shared_ptr<const parsed_spec>
+        recheck_imports(const parsed_spec& p)
+        {
+            auto q = std::make_shared<parsed_spec>(p);
+            for (auto& imp : q->imports) {
+                std::time_t now = std::time(nullptr);
+                struct stat st;
+                if (stat(imp.path.c_str(), &st) != 0
+                    || st.st_mtime != imp.mtime || st.st_size != imp.size) {
+                    return nullptr;
+                }
+                if (imp.mtime < imp.checked_at) {
+                    continue;
+                }
+
+                std::ifstream ifs(imp.path);
+                std::ostringstream oss;
+                oss << ifs.rdbuf();
+                if (!ifs || fnv1a_hash(oss.str()) != imp.hash) {
+                    return nullptr;
+                }
+                imp.checked_at = now;
+            }
+            return q;
+        }
+
+        static bool is_ready(const parsed_future& f)
+        {
+            return f.wait_for(std::chrono::seconds(0))
+                    == std::future_status::ready;
+        }
+
+        // Reads and parses the file unless its content is the same as that of
+        // the last entry. Throws etsl_syntax_error or std::runtime_error.
+        static std::shared_ptr<const parsed_spec>
+        parse(const std::string& filename, const entry* last)
+        {
+            std::ifstream ifs(filename);
+            if (!ifs) {
+                throw std::runtime_error("cannot open " + filename);
+            }
+            std::ostringstream oss;
+            oss << ifs.rdbuf();
+            std::string input = oss.str();
+            unsigned long long hash = fnv1a_hash(input);
+
+            if (last != nullptr) {
+                try {
+                    auto p = last->parsed.get();
+                    if (p->hash == hash) {
+                        if (auto q = recheck_imports(*p)) {
+                            return q;
+                        }
+                    }
+                }
+                catch (std::exception&) {
+                    // The last parse failed.
+                }
+            }
+
+            // The sub-specs are checked against the content they were parsed
+            // from, which they may have changed from by the time they are
+            // stat'ed.
+            auto p = std::make_shared<parsed_spec>();
+            p->hash = hash;
+            std::time_t parsed_at = std::time(nullptr);
+            p->spec = std::make_shared<const etsl_spec>(
+                    etsl_spec::parse(input, parent_directory(filename)));
+            auto paths = p->spec->imported_files();
+            auto hashes = p->spec->imported_file_hashes();
+            for (size_t i = 0; i < paths.size(); ++i) {
+                struct stat imp_st;
+                if (stat(paths[i].c_str(), &imp_st) != 0) {
+                    // Removed since; never unchanged.
+                    imp_st.st_mtime = 0;
+                    imp_st.st_size = -1;
+                }
+                p->imports.push_back({paths[i], imp_st.st_mtime,
+                                      imp_st.st_size, parsed_at, hashes[i]});
+            }
+            return p;
+        }
+
+    public:
+        std::shared_ptr<const etsl_spec> get(const std::string& filename)
+        {
+            struct stat st;
+            if (stat(filename.c_str(), &st) != 0) {
+                throw std::runtime_error("cannot open " + filename);
+            }
+
+            entry last;
+            bool has_last = false;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = entries_.find(filename);
+                if (it != end(entries_)) {
+                    last = it->second;
+                    has_last = true;
+                }
+            }
+
+            // The file may still change within the second it was checked
+            // without changing its mtime, so such an entry is verified by
+            // the content unless it is still being parsed.
+            if (has_last && last.mtime == st.st_mtime
+                && last.size == st.st_size
+                && (last.mtime < last.checked_at || !is_ready(last.parsed))) {
+                auto p = last.parsed.get();
+                if (imports_unchanged(*p)) {
+                    return p->spec;
+                }
+            }
+
+            std::promise<std::shared_ptr<const parsed_spec>> promise;
+            entry e;
+            e.mtime = st.st_mtime;
+            e.size = st.st_size;
+            e.checked_at = std::time(nullptr);
+            e.parsed = promise.get_future().share();
+            parsed_future other;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = entries_.find(filename);
+                if (it != end(entries_)
+                    && (!has_last || it->second.id != last.id)) {
+                    other = it->second.parsed;
+                }
+                else {
+                    e.id = next_id_++;
+                    entries_[filename] = e;
+                }
+            }
+
+            // Another request has started reading the file since.
+            if (other.valid()) {
+                return other.get()->spec;
+            }
+
+            try {
+                auto p = parse(filename, has_last ? &last : nullptr);
+                promise.set_value(p);
+                return p->spec;
+            }
+            catch (...) {
+                // Failures are not cached.
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    auto it = entries_.find(filename);
+                    if (it != end(entries_) && it->second.id == e.id) {
+                        entries_.erase(it);
+                    }
+                }
+                promise.set_exception(std::current_exception());
+                throw;
+            }
+        }
+    };
+
+    namespace details {
+        // Buffered stream over a file descriptor.
+        class fd_streambuf : public std::streambuf {
+        private:
+            int fd_;
+            char in_buf_[4096];
+            char out_buf_[4096];
+
+        protected:
+            int_type underflow() override
+            {
+                ssize_t n = ::read(fd_, in_buf_, sizeof(in_buf_));
+                if (n <= 0) {
+                    return traits_type::eof();
+                }
+                setg(in_buf_, in_buf_, in_buf_ + n);
+                return traits_type::to_int_type(in_buf_[0]);
+            }
+
+            int_type overflow(int_type c) override
+            {
+                if (sync() != 0) {
+                    return traits_type::eof();
+                }
+                if (!traits_type::eq_int_type(c, traits_type::eof())) {
+                    *pptr() = traits_type::to_char_type(c);
+                    pbump(1);
+                }
+                return traits_type::not_eof(c);
+            }
+
+            // Writes to a socket without raising SIGPIPE if the peer has
+            // closed it, which would kill the whole server.
+            int sync() override
+            {
+                const char* p = pbase();
+                while (p < pptr()) {
+#ifdef MSG_NOSIGNAL
+                    ssize_t n = ::send(fd_, p, pptr() - p, MSG_NOSIGNAL);
+#else
+                    ssize_t n = ::write(fd_, p, pptr() - p);
+#endif
+                    if (n < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    if (n <= 0) {
+                        return -1;
+                    }
+                    p += n;
+                }
+                setp(out_buf_, out_buf_ + sizeof(out_buf_));
+                return 0;
+            }
+
+        public:
+            explicit fd_streambuf(int fd) : fd_(fd)
+            {
+                setg(in_buf_, in_buf_, in_buf_);
+                setp(out_buf_, out_buf_ + sizeof(out_buf_));
+#if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+                int on = 1;
+                setsockopt(fd_, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+            }
+        };
+
+        // Splits a request line into its words, which may be quoted.
+        inline std::vector<std::string> split_request(const std::string& line)
+        {
+            std::vector<std::string> words;
+            size_t i = 0;
+            for (;;) {
+                while (i < line.size() && std::isspace(
+                               static_cast<unsigned char>(line[i]))) {
+                    ++i;
+                }
+                if (i == line.size()) {
+                    return words;
+                }
+
+                std::string word;
+                if (line[i] == '"') {
+                    for (++i; i < line.size() && line[i] != '"'; ++i) {
+                        if (line[i] == '\\' && i + 1 < line.size()) {
+                            ++i;
+                        }
+                        word.push_back(line[i]);
+                    }
+                    if (i == line.size()) {
+                        throw std::runtime_error("invalid request");
+                    }
+                    ++i;
+                }
+                else {
+                    for (; i < line.size() && !std::isspace(static_cast<
+                                                  unsigned char>(line[i]));
+                         ++i) {
+                        word.push_back(line[i]);
+                    }
+                }
+                words.push_back(std::move(word));
+            }
+        }
+
+        // Quotes the word if it has whitespace, quotes or backslashes in it.
+        inline std::string quote_request_word(const std::string& word)
+        {
+            bool plain = !word.empty() && word[0] != '"';
+            for (char c : word) {
+                if (std::isspace(static_cast<unsigned char>(c)) || c == '\\') {
+                    plain = false;
+                }
+            }
+            if (plain) {
+                return word;
+            }
+
+            std::string quoted = "\"";
+            for (char c : word) {
+                if (c == '"' || c == '\\') {
+                    quoted.push_back('\\');
+                }
+                quoted.push_back(c);
+            }
+            quoted.push_back('"');
+            return quoted;
+        }
+
+        // Writes the response to the request. Throws before writing anything
+        // if the request fails.
+        inline void handle_etsl_request(const std::vector<std::string>& args,
+                                        etsl_spec_cache& cache,
+                                        std::ostream& os)
+        {
+            auto invalid = [] {
+                return std::runtime_error("invalid request");
+            };
+            if (args.empty()) {
+                throw invalid();
+            }
+
+            // Reports syntax errors in the file:line:col: format.
+            auto load = [&](const std::string& filename) {
+                try {
+                    return cache.get(filename);
+                }
+                catch (etsl_syntax_error& e) {
+                    std::ostringstream oss;
+                    oss << filename << ":" << e.line_num << ":" << e.col_num
+                        << ": " << e.what();
+                    throw std::runtime_error(oss.str());
+                }
+            };
+
+            std::ostringstream payload;
+            if (args[0] == "generate") {
+                size_t i = 1;
+                etsl_write_options options;
+                if (i < args.size() && args[i] == "-g") {
+                    options.order = frame_order::gray;
+                    ++i;
+                }
+                if (i == args.size() || args.size() > i + 2) {
+                    throw invalid();
+                }
+
+                const std::string& input_filename = args[i];
+                std::string output_filename = i + 1 < args.size()
+                        ? args[i + 1]
+                        : input_filename + ".tsl";
+
+                auto spec = load(input_filename);
+                if (output_filename == "-") {
+                    os << "ok " << spec->frames_size() << "\n";
+
+                    // Stop writing once the client is gone.
+                    options.on_progress = [&](const etsl_frame_position&) {
+                        if (!os) {
+                            throw std::runtime_error("cannot write");
+                        }
+                    };
+                    try {
+                        spec->write_frames(os, options);
+                    }
+                    catch (std::exception&) {
+                        // The payload cannot be completed.
+                        os.setstate(std::ios::badbit);
+                    }
+                    return;
+                }
+                else {
+                    std::ofstream ofs(output_filename);
+                    spec->write_frames(ofs, options);
+                    if (!ofs.flush()) {
+                        throw std::runtime_error("cannot write "
+                                                 + output_filename);
+                    }
+                }
+            }
+            else if (args[0] == "count") {
+                if (args.size() != 2) {
+                    throw invalid();
+                }
+                payload << load(args[1])->count_frames() << "\n";
+            }
+            else if (args[0] == "frame") {
+                if (args.size() != 3) {
+                    throw invalid();
+                }
+                auto spec = load(args[1]);
+                if (!spec->write_frame(payload, parse_frame_key(args[2]))) {
+                    throw std::runtime_error("no frame with key " + args[2]);
+                }
+            }
+            else {
+                throw invalid();
+            }
+
+            std::string str = payload.str();
+            os << "ok " << str.size() << "\n" << str;
+        }
+
+        // Serves the requests read from is until the end of the stream or a
+        // response cannot be written.
+        inline void serve_etsl_requests(std::istream& is, std::ostream& os,
+                                        etsl_spec_cache& cache)
+        {
+            std::string line;
+            while (std::getline(is, line)) {
+                try {
+                    auto args = split_request(line);
+                    if (args.empty()) {
+                        continue;
+                    }
+                    handle_etsl_request(args, cache, os);
+                }
+                catch (std::exception& e) {
+                    os << "error " << e.what() << "\n";
+                }
+
+                // Stop serving the client if it is gone or the response is
+                // incomplete.
+                if (!os.flush()) {
+                    break;
+                }
+            }
+        }
+
+        // See etsl::serve_etsl_unix_socket().
+        inline void serve_etsl_unix_socket(const std::string& path,
+                                           size_t max_clients)
+        {
+            sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(addr.sun_path)) {
+                throw std::runtime_error("socket path too long: " + path);
+            }
+            path.copy(addr.sun_path, path.size());
+
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd < 0) {
+                throw std::runtime_error("cannot create socket");
+            }
+            ::unlink(path.c_str());
+            if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+                || listen(fd, SOMAXCONN) != 0) {
+                ::close(fd);
+                throw std::runtime_error("cannot listen on " + path);
+            }
+
+            if (max_clients == 0) {
+                max_clients
+                        = 2 * std::max(std::thread::hardware_concurrency(), 1u);
+            }
+
+            etsl_spec_cache cache;
+            etsl_thread_pool pool(max_clients);
+            for (;;) {
+                int client_fd = accept(fd, nullptr, nullptr);
+                if (client_fd < 0) {
+                    if (errno == EINTR || errno == ECONNABORTED) {
+                        continue;
+                    }
+                    if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS
+                        || errno == ENOMEM) {
+                        // Wait for the clients being served to close their
+                        // connections.
+                        std::this_thread::sleep_for(
+                                std::chrono::milliseconds(100));
+                        continue;
+                    }
+                    ::close(fd);
+                    throw std::runtime_error("cannot accept connections on "
+                                             + path);
+                }
+
+                // Blocks while the threads are busy and enough clients are
+                // waiting for them.
+                pool.submit([client_fd, &cache] {
+                    try {
+                        fd_streambuf buf(client_fd);
+                        std::istream is(&buf);
+                        std::ostream os(&buf);
+                        serve_etsl_requests(is, os, cache);
+                    }
+                    catch (...) {
+                        // The task must not throw.
+                    }
+                    ::close(client_fd);
+                });
+            }
+        }
+
+        // See etsl::request_etsl_server().
+        inline void request_etsl_server(const std::string& path,
+                                        const std::vector<std::string>& args,
+                                        std::ostream& payload_os)
+        {
+            sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(addr.sun_path)) {
+                throw std::runtime_error("socket path too long: " + path);
+            }
+            path.copy(addr.sun_path, path.size());
+
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd < 0
+                || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))
+                        != 0) {
+                if (fd >= 0) {
+                    ::close(fd);
+                }
+                throw std::runtime_error("cannot connect to " + path);
+            }
+
+            fd_streambuf buf(fd);
+            std::iostream ios(&buf);
+            for (size_t i = 0; i < args.size(); ++i) {
+                ios << (i == 0 ? "" : " ") << quote_request_word(args[i]);
+            }
+            ios << "\n" << std::flush;
+            ::shutdown(fd, SHUT_WR);
+
+            std::string status;
+            std::string rest;
+            ios >> status;
+            std::getline(ios, rest);
+            trim_inplace(rest);
+
+            bool complete = false;
+            if (status == "ok") {
+                unsigned long long size = 0;
+                try {
+                    size = std::stoull(rest);
+                }
+                catch (std::logic_error&) {
+                    ::close(fd);
+                    throw std::runtime_error("invalid response from " + path);
+                }
+
+                char chunk[65536];
+                while (size != 0
+                       && ios.read(chunk, std::min<unsigned long long>(
+                                                  size, sizeof(chunk)))) {
+                    payload_os.write(chunk, ios.gcount());
+                    size -= ios.gcount();
+                }
+                complete = size == 0;
+            }
+            ::close(fd);
+
+            if (status == "error") {
+                throw std::runtime_error(rest);
+            }
+            else if (!complete) {
+                throw std::runtime_error("invalid response from " + path);
+            }
+        }
+    }
+}
+
+#endif
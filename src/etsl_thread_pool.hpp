@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2017, Yutaka Tsutano
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ETSL_THREAD_POOL_HPP
+#define ETSL_THREAD_POOL_HPP
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+namespace etsl {
+    // Fixed number of worker threads running the submitted tasks in the order
+    // they are submitted. submit() blocks while max_pending tasks are waiting
+    // so that the memory held by pending tasks stays bounded.
+    class etsl_thread_pool {
+    private:
+        std::vector<std::thread> workers_;
+        std::deque<std::function<void()>> tasks_;
+        size_t max_pending_;
+        size_t running_ = 0;
+        bool stopping_ = false;
+
+        std::mutex mutex_;
+        std::condition_variable task_added_;
+        std::condition_variable task_taken_;
+        std::condition_variable task_done_;
+
+    private:
+        void run()
+        {
+            for (;;) {
+                std::function<void()> task;
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    task_added_.wait(lock, [&] {
+                        return stopping_ || !tasks_.empty();
+                    });
+                    if (tasks_.empty()) {
+                        return;
+                    }
+                    task = std::move(tasks_.front());
+                    tasks_.pop_front();
+                    ++running_;
+                }
+                task_taken_.notify_one();
+
+                task();
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    --running_;
+                }
+                task_done_.notify_all();
+            }
+        }
+
+    public:
+        // Uses as many threads as the hardware supports if num_threads is 0.
+        explicit etsl_thread_pool(size_t num_threads = 0,
+                                  size_t max_pending = 0)
+        {
+            if (num_threads == 0) {
+                num_threads = std::thread::hardware_concurrency();
+            }
+            if (num_threads == 0) {
+                num_threads = 1;
+            }
+            max_pending_ = max_pending != 0 ? max_pending : 2 * num_threads;
+
+            for (size_t i = 0; i < num_threads; ++i) {
+                workers_.emplace_back([this] { run(); });
+            }
+        }
+
+        ~etsl_thread_pool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopping_ = true;
+            }
+            task_added_.notify_all();
+            for (auto& w : workers_) {
+                w.join();
+            }
+        }
+
+        etsl_thread_pool(const etsl_thread_pool&) = delete;
+        etsl_thread_pool& operator=(const etsl_thread_pool&) = delete;
+
+        size_t size() const
+        {
+            return workers_.size();
+        }
+
+        // The task must not throw.
+        void submit(std::function<void()> task)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                task_taken_.wait(lock,
+                                 [&] { return tasks_.size() < max_pending_; });
+                tasks_.push_back(std::move(task));
+            }
+            task_added_.notify_one();
+        }
+
+        // Waits until all the submitted tasks are done.
+        void wait()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            task_done_.wait(lock,
+                            [&] { return tasks_.empty() && running_ == 0; });
+        }
+    };
+}
+
+#endif
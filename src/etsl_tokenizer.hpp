@@ -17,20 +17,17 @@
 #ifndef ETSL_TOKENIZER_HPP
 #define ETSL_TOKENIZER_HPP
 
+#include <istream>
+#include <iterator>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "etsl.hpp"
 #include "etsl_file.hpp"
 #include "algorithm.hpp"
 
 namespace etsl {
-    struct etsl_syntax_error : std::runtime_error {
-        int line_num;
-        int col_num;
-
-        etsl_syntax_error(int line_num, int col_num, std::string what)
-                : runtime_error(what), line_num(line_num), col_num(col_num)
-        {
-        }
-    };
-
     struct etsl_token {
         enum {
             kind_unknown,
@@ -43,70 +40,86 @@ namespace etsl {
         int col_num = 0;
     };
 
-    std::vector<etsl_token> etsl_tokenize(std::istream& is)
-    {
-        std::vector<etsl_token> tokens(1);
-
-        int line_num = 1;
-        int col_num = 0;
-
-        bool in_constraints = false;
-
-        char c;
-        while (is.get(c)) {
-            if (c == '\r') {
-                continue;
-            }
+    namespace details {
+        // Tokenizes [first, last), which starts at the beginning of line
+        // line_num outside of any attribute, appending the tokens to tokens.
+        // The last token, which is unfinished, is continued by the input
+        // after last. The tokens are not trimmed. Returns the line number at
+        // last.
+        inline int tokenize_chunk(const char* first, const char* last,
+                                  int line_num, std::vector<etsl_token>& tokens)
+        {
+            int col_num = 0;
 
-            ++col_num;
+            bool in_constraints = false;
 
-            switch (c) {
-            case '\n':
-                ++line_num;
-                col_num = 0;
-                continue;
-            case '#':
-                // Ignore a comment.
-                is.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-                ++line_num;
-                col_num = 0;
-                break;
-            case '[':
-                in_constraints = true;
-                break;
-            case ']':
-                tokens.back().kind = etsl_token::kind_attribute;
-                tokens.back().line_num = line_num;
-                tokens.back().col_num = col_num;
-                tokens.emplace_back();
-                in_constraints = false;
-                break;
-            case ':':
-                if (!in_constraints) {
-                    tokens.back().kind = etsl_token::kind_category;
-                    tokens.back().line_num = line_num;
-                    tokens.back().col_num = col_num;
-                    tokens.emplace_back();
+            for (const char* p = first; p != last; ++p) {
+                char c = *p;
+                if (c == '\r') {
+                    continue;
                 }
-                else {
-                    tokens.back().str.push_back(c);
-                }
-                break;
-            case '.':
-                if (!in_constraints) {
-                    tokens.back().kind = etsl_token::kind_choice;
+
+                ++col_num;
+
+                switch (c) {
+                case '\n':
+                    ++line_num;
+                    col_num = 0;
+                    continue;
+                case '#':
+                    // Ignore a comment.
+                    p = std::find(p, last, '\n');
+                    if (p == last) {
+                        --p;
+                    }
+                    ++line_num;
+                    col_num = 0;
+                    break;
+                case '[':
+                    in_constraints = true;
+                    break;
+                case ']':
+                    tokens.back().kind = etsl_token::kind_attribute;
                     tokens.back().line_num = line_num;
                     tokens.back().col_num = col_num;
                     tokens.emplace_back();
-                }
-                else {
+                    in_constraints = false;
+                    break;
+                case ':':
+                    if (!in_constraints) {
+                        tokens.back().kind = etsl_token::kind_category;
+                        tokens.back().line_num = line_num;
+                        tokens.back().col_num = col_num;
+                        tokens.emplace_back();
+                    }
+                    else {
+                        tokens.back().str.push_back(c);
+                    }
+                    break;
+                case '.':
+                    if (!in_constraints) {
+                        tokens.back().kind = etsl_token::kind_choice;
+                        tokens.back().line_num = line_num;
+                        tokens.back().col_num = col_num;
+                        tokens.emplace_back();
+                    }
+                    else {
+                        tokens.back().str.push_back(c);
+                    }
+                    break;
+                default:
                     tokens.back().str.push_back(c);
                 }
-                break;
-            default:
-                tokens.back().str.push_back(c);
             }
+
+            return line_num;
         }
+    }
+
+    inline std::vector<etsl_token> etsl_tokenize(const char* data, size_t size)
+    {
+        std::vector<etsl_token> tokens(1);
+        details::tokenize_chunk(data, data + size, 1, tokens);
         tokens.pop_back();
 
         for (auto& t : tokens) {
@@ -116,10 +129,18 @@ namespace etsl {
         return tokens;
     }
 
-    std::vector<std::string> etsl_attr_subtokenize(const etsl_token& token)
+    inline std::vector<etsl_token> etsl_tokenize(std::istream& is)
+    {
+        std::string input((std::istreambuf_iterator<char>(is)),
+                          std::istreambuf_iterator<char>());
+        return etsl_tokenize(input.data(), input.size());
+    }
+
+    inline std::vector<std::string> etsl_attr_subtokenize(const etsl_token& token)
     {
         static const char* keywords[]
-                = {"if", "else", "property", "single", "error"};
+                = {"if", "else", "property", "single", "error", "range",
+                   "values", "import"};
 
         std::vector<std::string> attr_subtokens(1);
 
@@ -141,10 +162,24 @@ namespace etsl {
             case ')':
             case '!':
             case ',':
+            case '<':
+            case '>':
+            case '=':
                 if (!attr_subtokens.back().empty()) {
                     attr_subtokens.emplace_back();
                 }
                 attr_subtokens.back() = *it;
+
+                // Comparison operators <=, >=, ==, and !=.
+                if (*it != '(' && *it != ')' && *it != ','
+                    && it + 1 != end(token.str) && *(it + 1) == '=') {
+                    ++it;
+                    attr_subtokens.back().push_back(*it);
+                }
+                else if (*it == '=') {
+                    throw etsl_syntax_error(token.line_num, token.col_num,
+                                            "invalid attribute");
+                }
                 attr_subtokens.emplace_back();
                 break;
             case '|':
@@ -16,15 +16,47 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <vector>
 #include <cstdlib>
+#include <string>
+#include <stdexcept>
+#include <functional>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <unordered_set>
+#include <climits>
 
-#include "etsl_parser.hpp"
-#include "etsl_frame_writer.hpp"
+#include <unistd.h>
+
+#include "etsl.hpp"
 
 struct program_configuration {
     bool count_only = false;
+    etsl::frame_order order = etsl::frame_order::lexicographic;
+    bool sample = false;
+    unsigned long long sample_size = 0;
+    unsigned long long seed = 0;
+    bool sample_unique = false;
+    bool checkpoint = false;
+    bool resume = false;
+    bool progress = false;
+    bool mmap = false;
+    bool compress = false;
+    etsl::compression_format compression = etsl::compression_format::gzip;
+    bool batch = false;
+    bool oracle = false;
+    bool coverage = false;
+    bool coverage_records = false;
+    bool delta = false;
+    unsigned long long coverage_strength = 2;
+    bool serve = false;
+    std::string socket_path = "";
     std::string input_filename = "";
+    std::vector<std::string> input_filenames;
     std::string output_filename = "";
 };
 
@@ -33,14 +65,67 @@ void print_manpage()
     std::cout << "(Manpage)\n";
 }
 
+unsigned long long parse_number_argument(int& i, int argc, char** argv)
+{
+    ++i;
+    if (i >= argc) {
+        throw std::runtime_error("invalid arguments");
+    }
+
+    try {
+        std::size_t pos;
+        unsigned long long n = std::stoull(argv[i], &pos);
+        if (argv[i][pos] == '\0') {
+            return n;
+        }
+    }
+    catch (std::logic_error&) {
+    }
+    throw std::runtime_error("invalid number " + std::string(argv[i]));
+}
+
+// Reads the input filenames listed in a manifest, one per line. Empty lines
+// and lines starting with # are ignored.
+void read_manifest(const std::string& filename,
+                   std::vector<std::string>& input_filenames)
+{
+    std::ifstream ifs(filename);
+    if (!ifs) {
+        throw std::runtime_error("cannot open " + filename);
+    }
+
+    std::string line;
+    while (std::getline(ifs, line)) {
+        auto first = line.find_first_not_of(" \t\r");
+        if (first != std::string::npos && line[first] != '#') {
+            auto last = line.find_last_not_of(" \t\r");
+            input_filenames.push_back(line.substr(first, last - first + 1));
+        }
+    }
+}
+
 program_configuration parse_arguments(int argc, char** argv)
 {
     program_configuration config;
     bool use_stdout = false;
 
     if (argc < 2) {
-        std::cerr << "usage: etsl [ --manpage ] [ -cs ] input_file [ -o "
-                     "output_file ]\n";
+        std::cerr << "usage: etsl [ --manpage ] [ -cgs ] [ -z gzip|zstd ] "
+                     "[ --sample n [ --seed s ] [ --unique ] ]\n"
+                     "            [ --checkpoint ] [ --resume ] [ --progress ] "
+                     "[ --mmap ]\n"
+                     "            input_file [ -o output_file ]\n"
+                     "       etsl --delta [ -gs ] input_file "
+                     "[ -o output_file ]\n"
+                     "       etsl --batch [ -cg ] input_file ... "
+                     "[ --manifest file ]\n"
+                     "       etsl --oracle input_file [ -o output_file ]\n"
+                     "       etsl --coverage [ -t n ] [ --binary | --delta ] "
+                     "input_file "
+                     "[ -o output_file ]\n"
+                     "       etsl --serve [ socket ]\n"
+                     "       etsl --connect socket [ -cgs ] input_file "
+                     "[ -o output_file ]\n";
         std::exit(1);
     }
 
@@ -51,6 +136,80 @@ program_configuration parse_arguments(int argc, char** argv)
             print_manpage();
             std::exit(0);
         }
+        else if (arg == "--sample") {
+            config.sample = true;
+            config.sample_size = parse_number_argument(i, argc, argv);
+            continue;
+        }
+        else if (arg == "--seed") {
+            config.seed = parse_number_argument(i, argc, argv);
+            continue;
+        }
+        else if (arg == "--unique") {
+            config.sample_unique = true;
+            continue;
+        }
+        else if (arg == "--checkpoint") {
+            config.checkpoint = true;
+            continue;
+        }
+        else if (arg == "--resume") {
+            config.checkpoint = true;
+            config.resume = true;
+            continue;
+        }
+        else if (arg == "--progress") {
+            config.progress = true;
+            continue;
+        }
+        else if (arg == "--mmap") {
+            config.mmap = true;
+            continue;
+        }
+        else if (arg == "--batch") {
+            config.batch = true;
+            continue;
+        }
+        else if (arg == "--oracle") {
+            config.oracle = true;
+            continue;
+        }
+        else if (arg == "--coverage") {
+            config.coverage = true;
+            continue;
+        }
+        else if (arg == "--binary") {
+            config.coverage_records = true;
+            continue;
+        }
+        else if (arg == "--delta") {
+            config.delta = true;
+            continue;
+        }
+        else if (arg == "--serve") {
+            config.serve = true;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                config.socket_path = argv[++i];
+            }
+            return config;
+        }
+        else if (arg == "--connect") {
+            ++i;
+            if (i >= argc) {
+                throw std::runtime_error("invalid arguments");
+            }
+            config.socket_path = argv[i];
+            continue;
+        }
+        else if (arg == "--manifest") {
+            ++i;
+            if (i >= argc) {
+                throw std::runtime_error("invalid arguments");
+            }
+            config.batch = true;
+            read_manifest(argv[i], config.input_filenames);
+            continue;
+        }
 
         if (!arg.empty() && arg[0] == '-') {
             for (char c : arg) {
@@ -58,6 +217,9 @@ program_configuration parse_arguments(int argc, char** argv)
                 case 'c':
                     config.count_only = true;
                     break;
+                case 'g':
+                    config.order = etsl::frame_order::gray;
+                    break;
                 case 's':
                     use_stdout = true;
                     break;
@@ -68,50 +230,477 @@ program_configuration parse_arguments(int argc, char** argv)
                     }
                     config.output_filename = argv[i];
                     break;
+                case 't':
+                    config.coverage_strength
+                            = parse_number_argument(i, argc, argv);
+                    break;
+                case 'z':
+                    ++i;
+                    if (i >= argc) {
+                        throw std::runtime_error("invalid arguments");
+                    }
+                    config.compress = true;
+                    config.compression
+                            = etsl::parse_compression_format(argv[i]);
+                    break;
                 }
             }
         }
         else {
             config.input_filename = arg;
+            config.input_filenames.push_back(arg);
+        }
+    }
+
+    if (config.batch) {
+        if (use_stdout || !config.output_filename.empty() || config.sample
+            || config.oracle || config.coverage || config.delta
+            || config.checkpoint || config.progress || config.mmap
+            || config.compress) {
+            throw std::runtime_error("invalid arguments for batch mode");
         }
+        return config;
     }
 
     if (config.input_filename == "") {
         throw std::runtime_error("missing input filename");
     }
 
+    if (config.coverage) {
+        // The report is written to the standard output by default.
+        if (config.oracle || config.count_only
+            || config.order != etsl::frame_order::lexicographic || config.sample
+            || config.checkpoint || config.progress || config.mmap
+            || config.compress || !config.socket_path.empty()
+            || config.coverage_strength == 0
+            || (config.coverage_records && config.delta)) {
+            throw std::runtime_error("invalid arguments for --coverage");
+        }
+        return config;
+    }
+
+    if (config.oracle) {
+        // The answers are written to the standard output by default.
+        if (config.count_only
+            || config.order != etsl::frame_order::lexicographic || config.sample
+            || config.checkpoint || config.progress || config.mmap
+            || config.compress || config.delta
+            || !config.socket_path.empty()) {
+            throw std::runtime_error("invalid arguments for --oracle");
+        }
+        return config;
+    }
+
+    if (config.delta) {
+        if (config.count_only || config.sample || config.checkpoint
+            || config.progress || config.mmap || config.compress
+            || !config.socket_path.empty()) {
+            throw std::runtime_error("invalid arguments for --delta");
+        }
+        if (!use_stdout && config.output_filename.empty()) {
+            config.output_filename = config.input_filename + ".tsld";
+        }
+        return config;
+    }
+
     if (!use_stdout && config.output_filename.empty()) {
         config.output_filename = config.input_filename + ".tsl";
+        if (config.compress) {
+            config.output_filename
+                    += config.compression == etsl::compression_format::gzip
+                    ? ".gz"
+                    : ".zst";
+        }
+    }
+
+    if (config.checkpoint && config.output_filename.empty()) {
+        throw std::runtime_error("checkpoints need an output file");
+    }
+
+    if (config.compress && (config.checkpoint || config.mmap)) {
+        throw std::runtime_error("invalid arguments for -z");
+    }
+
+    if (config.mmap
+        && (config.output_filename.empty() || config.sample
+            || config.checkpoint || config.progress
+            || config.order != etsl::frame_order::lexicographic)) {
+        throw std::runtime_error("invalid arguments for --mmap");
+    }
+
+    // Sampled frames are written in the order of their keys at once.
+    if (config.sample
+        && (config.count_only || config.checkpoint || config.progress
+            || config.order != etsl::frame_order::lexicographic)) {
+        throw std::runtime_error("invalid arguments for --sample");
+    }
+
+    if (!config.socket_path.empty()
+        && (config.sample || config.checkpoint || config.progress
+            || config.mmap || config.compress)) {
+        throw std::runtime_error("invalid arguments for --connect");
     }
 
     return config;
 }
 
+void print_syntax_error(std::ostream& os, const std::string& filename,
+                        const etsl::etsl_syntax_error& e)
+{
+    os << filename << ":";
+    os << e.line_num << ":";
+    os << e.col_num << ": ";
+    os << e.what() << "\n";
+}
+
+// Returns the output file of an input file in batch mode with its directory
+// resolved, so that the same output reached through different paths compares
+// equal.
+std::string resolved_output_filename(const std::string& filename)
+{
+    auto pos = filename.rfind('/');
+    std::string dir = pos == std::string::npos
+            ? "."
+            : filename.substr(0, pos == 0 ? 1 : pos);
+    char resolved[PATH_MAX];
+    if (realpath(dir.c_str(), resolved) == nullptr) {
+        return filename + ".tsl";
+    }
+    return std::string(resolved) + "/"
+            + filename.substr(filename.rfind('/') + 1) + ".tsl";
+}
+
+// Generates the frames for each input file on a thread per core. An error in a
+// file is reported without stopping the others. An input file given more
+// than once is processed once so that its output is not written
+// concurrently.
+int run_batch(const program_configuration& config)
+{
+    std::vector<std::string> filenames;
+    std::unordered_set<std::string> outputs;
+    for (const auto& filename : config.input_filenames) {
+        if (outputs.insert(resolved_output_filename(filename)).second) {
+            filenames.push_back(filename);
+        }
+    }
+
+    std::vector<unsigned long long> counts(filenames.size());
+    std::vector<char> failed(filenames.size(), false);
+    std::mutex cerr_mutex;
+    std::atomic<size_t> next(0);
+
+    auto process = [&] {
+        for (;;) {
+            size_t i = next++;
+            if (i >= filenames.size()) {
+                break;
+            }
+
+            const auto& filename = filenames[i];
+            std::ostringstream err;
+            try {
+                // Each spec is parsed serially since the files are already
+                // processed in parallel.
+                auto spec = etsl::etsl_spec::parse_file(filename, 1);
+
+                if (config.count_only) {
+                    counts[i] = spec.count_frames();
+                }
+                else {
+                    std::string output_filename = filename + ".tsl";
+                    std::ofstream ofs(output_filename);
+                    etsl::etsl_write_options options;
+                    options.order = config.order;
+                    spec.write_frames(ofs, options);
+                    if (!ofs.flush()) {
+                        throw std::runtime_error("cannot write "
+                                                 + output_filename);
+                    }
+                }
+            }
+            catch (etsl::etsl_syntax_error& e) {
+                print_syntax_error(err, filename, e);
+            }
+            catch (std::exception& e) {
+                // An error must not escape the thread.
+                err << filename << ": " << e.what() << "\n";
+            }
+
+            if (!err.str().empty()) {
+                std::lock_guard<std::mutex> lock(cerr_mutex);
+                std::cerr << err.str();
+                failed[i] = true;
+            }
+        }
+    };
+
+    size_t num_threads = std::min<size_t>(
+            std::max(std::thread::hardware_concurrency(), 1u),
+            filenames.size());
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < num_threads; ++t) {
+        threads.emplace_back(process);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    if (config.count_only) {
+        for (size_t i = 0; i < filenames.size(); ++i) {
+            if (!failed[i]) {
+                std::cout << filenames[i] << ": " << counts[i]
+                          << " test frames generated\n";
+            }
+        }
+    }
+
+    return std::count(begin(failed), end(failed), true) != 0 ? 1 : 0;
+}
+
+std::string absolute_path(const std::string& path)
+{
+    if (!path.empty() && path[0] == '/') {
+        return path;
+    }
+
+    std::vector<char> buf(4096);
+    if (getcwd(buf.data(), buf.size()) == nullptr) {
+        throw std::runtime_error("cannot get the current directory");
+    }
+    return std::string(buf.data()) + "/" + path;
+}
+
+// Sends the request to the server started by --serve instead of processing
+// the input file in this process.
+int run_client(const program_configuration& config)
+{
+    std::string input_path = absolute_path(config.input_filename);
+
+    std::vector<std::string> args;
+    if (config.count_only) {
+        args = {"count", input_path};
+    }
+    else {
+        args.push_back("generate");
+        if (config.order == etsl::frame_order::gray) {
+            args.push_back("-g");
+        }
+        args.push_back(input_path);
+        args.push_back(config.output_filename.empty()
+                               ? "-"
+                               : absolute_path(config.output_filename));
+    }
+
+    // The frames are written as they are received.
+    std::ostringstream count_payload;
+    try {
+        etsl::request_etsl_server(config.socket_path, args,
+                                  config.count_only ? count_payload
+                                                    : std::cout);
+    }
+    catch (std::runtime_error& e) {
+        // Syntax errors are reported with the input filename as given.
+        std::string message = e.what();
+        if (message.compare(0, input_path.size() + 1, input_path + ":") == 0) {
+            std::cerr << config.input_filename
+                      << message.substr(input_path.size()) << "\n";
+            return 1;
+        }
+        throw;
+    }
+
+    if (config.count_only) {
+        std::string payload = count_payload.str();
+        std::cout << payload.substr(0, payload.find('\n'))
+                  << " test frames generated\n";
+    }
+    return 0;
+}
+
+// Calls write with the output stream, compressing the output if requested.
+// The block index of a compressed output file is written next to it.
+void write_output(const program_configuration& config, std::ostream& os,
+                  const std::function<void(std::ostream&)>& write)
+{
+    if (!config.compress) {
+        write(os);
+        return;
+    }
+
+    std::ofstream index_ofs;
+    if (!config.output_filename.empty()) {
+        index_ofs.open(config.output_filename + ".idx");
+        if (!index_ofs) {
+            throw std::runtime_error("cannot open " + config.output_filename
+                                     + ".idx");
+        }
+    }
+
+    etsl::write_compressed(os, config.compression,
+                           index_ofs.is_open() ? &index_ofs : nullptr, write);
+
+    if (index_ofs.is_open() && !index_ofs.flush()) {
+        throw std::runtime_error("cannot write " + config.output_filename);
+    }
+}
+
+void write_frames(const program_configuration& config,
+                  const etsl::etsl_spec& spec)
+{
+    etsl::etsl_write_options options;
+    options.order = config.order;
+    options.report_progress = config.progress;
+
+    if (config.checkpoint) {
+        spec.write_frames_checkpointed(config.output_filename,
+                                       config.output_filename + ".ckpt",
+                                       options, config.resume);
+        return;
+    }
+
+    std::ofstream ofs;
+    std::ostream* os = &std::cout;
+    if (!config.output_filename.empty()) {
+        ofs.open(config.output_filename);
+        if (!ofs) {
+            throw std::runtime_error("cannot open " + config.output_filename);
+        }
+        os = &ofs;
+    }
+
+    write_output(config, *os, [&](std::ostream& out) {
+        spec.write_frames(out, options);
+    });
+    os->flush();
+    if (!*os) {
+        throw std::runtime_error("cannot write " + config.output_filename);
+    }
+}
+
 int main(int argc, char** argv)
 {
     try {
         auto config = parse_arguments(argc, argv);
 
+        if (config.oracle || config.coverage) {
+            // The input is read with std::getline().
+            std::ios::sync_with_stdio(false);
+        }
+
+        if (config.batch) {
+            return run_batch(config);
+        }
+
+        if (config.serve) {
+            if (config.socket_path.empty()) {
+                etsl::serve_etsl_requests(std::cin, std::cout);
+            }
+            else {
+                etsl::serve_etsl_unix_socket(config.socket_path);
+            }
+            return 0;
+        }
+
+        if (!config.socket_path.empty()) {
+            return run_client(config);
+        }
+
         try {
             // Read TSL file.
-            std::ifstream ifs(config.input_filename);
-            auto tokens = etsl::etsl_tokenize(ifs);
-            auto file = etsl::etsl_parse(tokens);
+            auto spec = etsl::etsl_spec::parse_file(config.input_filename);
+
+            if (config.coverage) {
+                // Read the executed frames from the standard input.
+                auto format = etsl::frame_format::keys;
+                if (config.coverage_records) {
+                    format = etsl::frame_format::records;
+                }
+                else if (config.delta) {
+                    format = etsl::frame_format::delta;
+                }
+
+                if (!config.output_filename.empty()) {
+                    std::ofstream ofs(config.output_filename);
+                    spec.write_coverage_report(std::cin, ofs, format,
+                                               config.coverage_strength);
+                    if (!ofs.flush()) {
+                        throw std::runtime_error("cannot write "
+                                                 + config.output_filename);
+                    }
+                }
+                else {
+                    spec.write_coverage_report(std::cin, std::cout, format,
+                                               config.coverage_strength);
+                }
+                return 0;
+            }
+
+            if (config.oracle) {
+                // Answer the queries read from the standard input.
+                if (!config.output_filename.empty()) {
+                    std::ofstream ofs(config.output_filename);
+                    spec.answer_expectation_queries(std::cin, ofs);
+                    if (!ofs) {
+                        throw std::runtime_error("cannot write "
+                                                 + config.output_filename);
+                    }
+                }
+                else {
+                    spec.answer_expectation_queries(std::cin, std::cout);
+                }
+                return 0;
+            }
+
+            if (config.delta) {
+                if (!config.output_filename.empty()) {
+                    std::ofstream ofs(config.output_filename,
+                                      std::ios::binary);
+                    if (!ofs) {
+                        throw std::runtime_error("cannot open "
+                                                 + config.output_filename);
+                    }
+                    spec.write_delta_frames(ofs, config.order);
+                    if (!ofs) {
+                        throw std::runtime_error("cannot write "
+                                                 + config.output_filename);
+                    }
+                }
+                else {
+                    spec.write_delta_frames(std::cout, config.order);
+                }
+                return 0;
+            }
+
+            if (config.count_only) {
+                std::cout << spec.count_frames()
+                          << " test frames generated\n";
+                return 0;
+            }
 
             // Write frames.
-            if (!config.output_filename.empty()) {
-                std::ofstream ofs(config.output_filename);
-                etsl::write_tsl_frames(ofs, file);
+            if (config.sample) {
+                auto write = [&](std::ostream& os) {
+                    spec.write_sampled_frames(os, config.sample_size,
+                                              config.seed,
+                                              config.sample_unique);
+                };
+                if (!config.output_filename.empty()) {
+                    std::ofstream ofs(config.output_filename);
+                    write_output(config, ofs, write);
+                }
+                else {
+                    write_output(config, std::cout, write);
+                }
+            }
+            else if (config.mmap) {
+                spec.write_frames_mmap(config.output_filename);
             }
             else {
-                etsl::write_tsl_frames(std::cout, file);
+                write_frames(config, spec);
             }
         }
         catch (etsl::etsl_syntax_error& e) {
-            std::cerr << config.input_filename << ":";
-            std::cerr << e.line_num << ":";
-            std::cerr << e.col_num << ": ";
-            std::cerr << e.what() << "\n";
+            print_syntax_error(std::cerr, config.input_filename, e);
             std::exit(1);
         }
     }